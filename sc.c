@@ -14,25 +14,59 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE	/* splice(2) */
+#endif
+
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <regex.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <sysexits.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <linux/serial.h>
+#endif
+#if defined(__linux__) && !defined(HAS_BROKEN_POLL) && !defined(NO_IO_URING) && \
+		defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "scbaud.h"
+#include "sccap.h"
 
 #if !defined(DEFAULTDEVICE)
 #define DEFAULTDEVICE	"cuad0"
@@ -46,6 +80,27 @@
 #if !defined(PATH_DEV)
 #define PATH_DEV "/dev"
 #endif
+#if !defined(RELAYBUFSIZE)
+#define RELAYBUFSIZE	16384
+#endif
+#if !defined(SPLICEMAX)
+#define SPLICEMAX	65536
+#endif
+#if !defined(QUEUESIZE)
+#define QUEUESIZE	(1024 * 1024)
+#endif
+#if !defined(LOGRINGSIZE)
+#define LOGRINGSIZE	(4 * 1024 * 1024)
+#endif
+#if !defined(PORTQUEUESIZE)
+#define PORTQUEUESIZE	(64 * 1024)
+#endif
+#if !defined(HISTORYSIZE)
+#define HISTORYSIZE	(64 * 1024 * 1024)
+#endif
+#if !defined(DRAINTIMEOUT)
+#define DRAINTIMEOUT	2000	/* ms to finish sending at exit */
+#endif
 
 #if B2400 == 2400 && B9600 == 9600 && B38400 == 38400
 #define TERMIOS_SPEED_IS_INT
@@ -146,12 +201,67 @@ enum escapestates {
 	ESCAPESTATE_PROCESSCMD,
 	ESCAPESTATE_WAITFOR1STHEXDIGIT,
 	ESCAPESTATE_WAITFOR2NDHEXDIGIT,
+	ESCAPESTATE_SEARCH,
+};
+
+/*
+ * Bounded byte queue used to decouple reading a descriptor from writing
+ * the data to a possibly slow one.  head and tail count bytes ever taken
+ * out and put in; size is a power of two.
+ */
+struct queue {
+	unsigned char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	unsigned long long dropped;
+};
+
+/* long options without a short equivalent */
+enum longopts {
+	OPT_REPLAY = 256,
+	OPT_RATE,
+	OPT_PTY,
+	OPT_CHARDELAY,
+	OPT_TXRATE,
+	OPT_INTERVAL,
+	OPT_COUNT,
+	OPT_DURATION,
+	OPT_EXPECT,
+	OPT_EXPECTFILE,
+	OPT_LISTEN,
+	OPT_DAEMON,
+	OPT_SCROLLBACK,
+	OPT_HISTORY,
+	OPT_BACKEND,
+	OPT_THREADS,
+	OPT_LOWLATENCY,
+	OPT_RENDER,
+	OPT_CONTROL,
+	OPT_IMAP,
+	OPT_OMAP,
+	OPT_LOGMAP,
+};
+
+enum queuepolicies {
+	QPOLICY_BLOCK = 0,
+	QPOLICY_DROP,
+	QPOLICY_RTS,
 };
 
 
 static volatile int scrunning = 1;
+static volatile sig_atomic_t gotsig = 0;
 static char *path_dev = PATH_DEV "/";
 static int qflag = 0;
+static int zflag = 0;
+static enum queuepolicies qpolicy = QPOLICY_BLOCK;
+static int rtsoff = 0;		/* owned by the reader thread with --threads */
+static atomic_ulong rtsthrottled = 0;
+static struct queue outq;	/* serial device -> stdout */
+static struct queue serq;	/* terminal -> serial device */
+static int useuring = -1;	/* --backend: 1 io_uring, 0 poll, -1 either */
+static int lowlat = -1;		/* --low-latency: SCHED_FIFO priority or 0, -1 off */
 
 #ifdef __CYGWIN__
 static int
@@ -178,11 +288,18 @@ static void
 sighandler(int sig)
 {
 	scrunning = 0;
+	gotsig = 1;
 }
 
 
+/*
+ * Parse speed into a code for cfsetspeed().  On Linux, a rate termios has
+ * no code for is returned in *other, to be set with scbaud_set() once the
+ * port is configured, and B38400 stands in for it until then.  *other is 0
+ * for all other speeds.
+ */
 static speed_t
-parsespeed(char *speed)
+parsespeed(char *speed, long *other)
 {
 	long s;
 	char *ep;
@@ -190,6 +307,7 @@ parsespeed(char *speed)
 	struct termios_speed *ts = termios_speeds;
 #endif
 
+	*other = 0;
 	s = strtol(speed, &ep, 0);
 	if (ep == speed || ep[0] != '\0') {
 		warnx("Unable to parse speed \"%s\"", speed);
@@ -203,6 +321,12 @@ parsespeed(char *speed)
 			return ts->code;
 		ts++;
 	}
+#if defined(__linux__)
+	if (s > 0) {
+		*other = s;
+		return(B38400);
+	}
+#endif
 	warnx("Undefined speed \"%s\"", speed);
 	return(B9600);
 #endif
@@ -250,10 +374,15 @@ parseparms(tcflag_t *c, char *p, int f, int m)
 }
 
 
+/*
+ * Report the settings of the port.  The speed is the one the driver says
+ * it achieved where it tells, and the one asked for is added if that
+ * differs.
+ */
 static void
-printparms(struct termios *ti, char *tty)
+printparms(struct termios *ti, int fd, char *tty, char *speed)
 {
-	long sp = 0;
+	long sp = 0, want;
 	char bits, parity, stops;
 #if !defined(TERMIOS_SPEED_IS_INT)
 	struct termios_speed *ts = termios_speeds;
@@ -272,6 +401,9 @@ printparms(struct termios *ti, char *tty)
 		ts++;
 	}
 #endif
+	if ((want = scbaud_get(fd)) > 0)
+		sp = want;
+	want = strtol(speed, NULL, 0);
 	switch(ti->c_cflag & CSIZE) {
 		case CS5: bits = '5'; break;
 		case CS6: bits = '6'; break;
@@ -287,12 +419,49 @@ printparms(struct termios *ti, char *tty)
 	}
 	stops = ti->c_cflag & CSTOPB ? '2' : '1';
 
-	fprintf(stderr, "Connected to %s at %ld %c%c%c, modem status %s, %shardware handshake\n",
-		tty, sp, bits, parity, stops,
+	fprintf(stderr, "Connected to %s at %ld", tty, sp);
+	if (want > 0 && want != sp)
+		fprintf(stderr, " (%ld requested)", want);
+	fprintf(stderr, " %c%c%c, modem status %s, %shardware handshake\n",
+		bits, parity, stops,
 		ti->c_cflag & CLOCAL ? "ignored" : "observed",
 		ti->c_cflag & CRTSCTS ? "" : "no ");
 }
 
+/*
+ * Put the serial port into raw mode at speed with parms, starting from the
+ * settings in *ti.  Returns 0, or an exit code after printing a warning.
+ */
+static int
+serialsetup(int fd, char *tty, struct termios *ti, char *speed, char *parms,
+		int fflag, int mflag)
+{
+	long other;
+
+	cfmakeraw(ti);
+	/*
+	 * No inter-byte timer: poll() reports the device readable as soon as
+	 * a single byte arrived, which is also what --low-latency wants.
+	 */
+	ti->c_cc[VMIN] = 1;
+	ti->c_cc[VTIME] = 0;
+	if (cfsetspeed(ti, parsespeed(speed, &other))) {
+		warn("cfsetspeed(%s)", tty);
+		return EX_OSERR;
+	}
+	if (parseparms(&ti->c_cflag, parms, fflag, mflag))
+		return EX_USAGE;
+	if (tcsetattr(fd, TCSANOW, ti)) {
+		warn("tcsetattr(%s)", tty);
+		return EX_OSERR;
+	}
+	if (other > 0 && scbaud_set(fd, other) < 0) {
+		warn("%s: speed %ld", tty, other);
+		return EX_OSERR;
+	}
+	return 0;
+}
+
 static int
 hex2dec(char c)
 {
@@ -324,193 +493,286 @@ hex2dec(char c)
   return -1;
 }
 
+/*
+ * Log-linear latency histogram in the style of HdrHistogram: values below
+ * 2^HIST_SUBBITS are counted exactly, larger ones in 2^(HIST_SUBBITS-1)
+ * buckets per power of two, i.e. with about 3% resolution.
+ */
+#define HIST_SUBBITS	6
+#define HIST_BUCKETS	((64 - HIST_SUBBITS + 1) << HIST_SUBBITS)
+
+struct hist {
+	unsigned long long count[HIST_BUCKETS];
+	unsigned long long n;
+	uint64_t max;
+};
+
 static int
-loop(const int sfd, const int escchr, const int msdelay, const char *key_sequence, int key_sequence_len)
+hist_bucket(uint64_t v)
 {
-	enum escapestates escapestate = ESCAPESTATE_WAITFOREC;
-	unsigned char escapedigit;
+	int e = 0;
+
+	while ((v >> e) >= (1 << HIST_SUBBITS))
+		e++;
+	return (e << HIST_SUBBITS) + (v >> e);
+}
+
+static void
+hist_add(struct hist *h, uint64_t v)
+{
+	h->count[hist_bucket(v)]++;
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*
+ * Value at or below which fraction q of the samples fall, as the upper
+ * bound of the bucket that contains it (but at most the largest sample).
+ */
+static uint64_t
+hist_quantile(const struct hist *h, double q)
+{
+	unsigned long long seen = 0, want;
+	uint64_t v;
 	int i;
-	char c;
 
-#if defined(HAS_BROKEN_POLL)
-	while (scrunning) {
-		fd_set fds;
-		struct timeval tv;
-		struct timeval *tvp = NULL;
+	if (h->n == 0)
+		return 0;
+	want = q * h->n;
+	if (want >= h->n)
+		want = h->n - 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > want)
+			break;
+	}
+	v = (((uint64_t)(i & ((1 << HIST_SUBBITS) - 1)) + 1) << (i >> HIST_SUBBITS)) - 1;
+	return v < h->max ? v : h->max;
+}
 
-		if (key_sequence && key_sequence_len > 0) {
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			tvp = &tv;
-		}
+/*
+ * Runtime statistics, shown with the ~s escape, on SIGUSR1 and when the
+ * connection is closed.
+ */
+struct stats {
+	unsigned long long rxbytes;	/* received from the serial device */
+	unsigned long long rxchunks;
+	unsigned long long txbytes;	/* sent to the serial device */
+	unsigned long long txchunks;
+	unsigned long long wakeups;	/* returns from poll() or io_uring_enter() */
+	unsigned long long shortwrites;	/* writes that did not take everything */
+	unsigned long long breaks;
+	struct hist txlatency;		/* terminal read to serial write, ns */
+};
 
-		FD_ZERO(fds);
-		FD_SET(STDIN_FILENO, fds);
-		FD_SET(sfd, fds);
+static struct stats st;
+static volatile sig_atomic_t statsrequested = 0;
 
-		if ((i = select(sfd+1, fds, NULL, NULL, tvp)) < 0
-				&& errno != EINTR) {
-			warn("select()");
-			return EX_OSERR;
-		}
-#else
-	struct pollfd pfds[2];
-	int poll_timeout = -1;
+#if defined(UNITTEST)
+static uint64_t testnow;	/* set by the self-tests, 0 for the real clock */
+#endif
 
-	if (key_sequence && key_sequence_len > 0) {
-		poll_timeout = 1000; /* milliseconds */
-	}
+static uint64_t
+nsnow(void)
+{
+	struct timespec ts;
 
-	memset(pfds, 0, sizeof(pfds));
-	pfds[0].fd = STDIN_FILENO;
-	pfds[0].events = POLLIN;
-	pfds[1].fd = sfd;
-	pfds[1].events = POLLIN;
-	while (scrunning) {
-		if ((i = poll(pfds, sizeof(pfds)/sizeof(pfds[0]), poll_timeout)) < 0
-				&& errno != EINTR) {
-			warn("poll()");
-			return EX_OSERR;
-		}
-		if ((pfds[0].revents | pfds[1].revents) & POLLNVAL) {
-			warnx("poll() does not support devices");
-			return EX_OSERR;
-		}
-		if (pfds[0].revents & (POLLERR|POLLHUP)) {
-			read(STDIN_FILENO, &c, 1);
-			warn("poll mask %04x read(tty)", pfds[0].revents);
-			return(EX_OSERR);
-		}
-		if (pfds[1].revents & (POLLERR|POLLHUP)) {
-			read(sfd, &c, 1);
-			warn("poll mask %04x read(serial)", pfds[1].revents);
-			return(EX_OSERR);
-		}
+#if defined(UNITTEST)
+	if (testnow != 0)
+		return testnow;
 #endif
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-		/* check timeout */
-		if (key_sequence && key_sequence_len > 0 && i == 0) {
-			i = write(sfd, key_sequence, key_sequence_len);
-			if (i != key_sequence_len) {
-				err(EX_OSERR, "could not write key sequence to serial device.");
+static void
+siginfohandler(int sig)
+{
+	statsrequested = 1;
+}
+
+
+#define queue_len(q)	((q)->tail - (q)->head)
+#define queue_space(q)	((q)->size - queue_len(q))
+
+static void
+queue_init(struct queue *q, size_t size)
+{
+	q->size = 1;
+	while (q->size < size)
+		q->size <<= 1;
+	q->buf = malloc(q->size);
+	if (q->buf == NULL)
+		err(EX_OSERR, "malloc(%zu)", q->size);
+	q->head = q->tail = 0;
+	q->dropped = 0;
+}
+
+/*
+ * Append len bytes.  If they do not fit, the oldest bytes are discarded
+ * and counted in q->dropped; callers that must not lose data check
+ * queue_space() first.
+ */
+static void
+queue_put(struct queue *q, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+	size_t off, n;
+
+	if (len > q->size) {
+		q->dropped += len - q->size;
+		s += len - q->size;
+		len = q->size;
+	}
+	if (len > queue_space(q)) {
+		n = len - queue_space(q);
+		q->dropped += n;
+		q->head += n;
+	}
+	off = q->tail & (q->size - 1);
+	n = q->size - off;
+	if (n > len)
+		n = len;
+	memcpy(q->buf + off, s, n);
+	memcpy(q->buf, s + n, len - n);
+	q->tail += len;
+}
+
+/*
+ * Describe the len bytes of the queue from position pos, which may wrap
+ * around the end of the buffer, in iov.  Returns the number of entries.
+ */
+static int
+queue_iov(const struct queue *q, size_t pos, size_t len, struct iovec iov[2])
+{
+	size_t off = pos & (q->size - 1);
+
+	iov[0].iov_base = q->buf + off;
+	iov[0].iov_len = q->size - off < len ? q->size - off : len;
+	iov[1].iov_base = q->buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return iov[1].iov_len > 0 ? 2 : 1;
+}
+
+/*
+ * Write up to max bytes of the queue to fd, as much as it will take
+ * without blocking.
+ */
+static int
+queue_flushn(struct queue *q, int fd, size_t max)
+{
+	struct iovec iov[2];
+	size_t len, end = q->head + (max < queue_len(q) ? max : queue_len(q));
+	ssize_t n;
+
+	while ((len = end - q->head) > 0) {
+		n = writev(fd, iov, queue_iov(q, q->head, len, iov));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				st.shortwrites++;
+				return 0;
 			}
+			return -1;
 		}
+		q->head += n;
+		if ((size_t)n < len)
+			st.shortwrites++;
+	}
+	return 0;
+}
 
-#if defined(HAS_BROKEN_POLL)
-		if (FD_ISSET(STDIN_FILENO, fds)) {
-#else
-		if (pfds[0].revents & POLLIN) {
-#endif
-			i = read(STDIN_FILENO, &c, 1);
-			if (i < 0) {
-				err(EX_OSERR, "could not read from STDIN.");
-			}
-			if (i > 0) {
-				switch (escapestate) {
-					case ESCAPESTATE_WAITFORCR:
-						if (c == '\r') {
-							escapestate = ESCAPESTATE_WAITFOREC;
-						}
-						break;
+static int
+queue_flush(struct queue *q, int fd)
+{
+	return queue_flushn(q, fd, queue_len(q));
+}
 
-					case ESCAPESTATE_WAITFOREC:
-						if (escchr != -1 && ((unsigned char)c) == escchr) {
-							escapestate = ESCAPESTATE_PROCESSCMD;
-							continue;
-						}
-						if (c != '\r') {
-							escapestate = ESCAPESTATE_WAITFORCR;
-						}
-						break;
-
-					case ESCAPESTATE_PROCESSCMD:
-						escapestate = ESCAPESTATE_WAITFORCR;
-						switch (c) {
-							case '.':
-								scrunning = 0;
-								continue;
-
-							case 'b':
-							case 'B':
-								if(!qflag)
-									fprintf(stderr, "->sending a break<-\r\n");
-								tcsendbreak(sfd, 0);
-								continue;
-
-							case 'k':
-							case 'K':
-								fprintf(stderr, "->stop sending key sequence<-\r\n");
-								key_sequence = NULL;
-								key_sequence_len = 0;
-								continue;
-
-							case 'x':
-							case 'X':
-								escapestate = ESCAPESTATE_WAITFOR1STHEXDIGIT;
-								continue;
-
-							default:
-								if (((unsigned char)c) != escchr) {
-									i = write(sfd, &escchr, 1);
-									if (i < 0) {
-										err(EX_OSERR, "could not write to serial device.");
-									}
-								}
-						}
-						break;
-
-					case ESCAPESTATE_WAITFOR1STHEXDIGIT:
-						if (isxdigit(c)) {
-							escapedigit = hex2dec(c) * 16;
-							escapestate = ESCAPESTATE_WAITFOR2NDHEXDIGIT;
-						} else {
-							escapestate = ESCAPESTATE_WAITFORCR;
-							if(!qflag)
-								fprintf(stderr, "->invalid hex digit '%c'<-\r\n", c);
-						}
-						continue;
+/*
+ * Offset of the first c among the first max bytes of the queue, or -1.
+ */
+static ssize_t
+queue_find(const struct queue *q, unsigned char c, size_t max)
+{
+	size_t off = q->head & (q->size - 1);
+	size_t n = q->size - off;
+	const unsigned char *p;
 
-					case ESCAPESTATE_WAITFOR2NDHEXDIGIT:
-						escapestate = ESCAPESTATE_WAITFORCR;
-						if(isxdigit(c)) {
-							escapedigit += hex2dec(c);
-							write(sfd, &escapedigit, 1);
-							if(!qflag)
-								fprintf(stderr, "->wrote 0x%02X character '%c'<-\r\n", escapedigit, isprint(escapedigit)?escapedigit:'.');
-						} else {
-							if(!qflag)
-								fprintf(stderr, "->invalid hex digit '%c'<-\r\n", c);
-						}
-						continue;
-				}
-				i = write(sfd, &c, 1);
-				if(c == '\n' && msdelay > 0) {
-					struct timespec d = {msdelay / 1000, (msdelay % 1000 ) * 1000 * 1000};
-					nanosleep(&d, &d);
-				}
-			}
-			if (i < 0) {
-				err(EX_OSERR, "could not write to serial device.");
-			}
+	if (max > queue_len(q))
+		max = queue_len(q);
+	if (n > max)
+		n = max;
+	if ((p = memchr(q->buf + off, c, n)) != NULL)
+		return p - (q->buf + off);
+	if ((p = memchr(q->buf, c, max - n)) != NULL)
+		return n + (p - q->buf);
+	return -1;
+}
+
+/*
+ * Queue len bytes for fd.  If nothing is queued already, the data is
+ * written straight from the caller's buffer and only the part fd does not
+ * take right away is copied into the queue.
+ */
+static int
+queue_write(struct queue *q, int fd, const void *p, size_t len)
+{
+	ssize_t n = 0;
+
+	if (queue_len(q) == 0) {
+		do {
+			n = write(fd, p, len);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			n = 0;
 		}
-#if defined(HAS_BROKEN_POLL)
-		if (FD_ISSET(sfd, fds)) {
-#else
-		if (pfds[1].revents & POLLIN) {
-#endif
-			i = read(sfd, &c, 1);
-			if (i < 0) {
-				err(EX_OSERR, "could not read from serial device.");
-			}
-			if (i > 0) {
-				i = write(STDOUT_FILENO, &c, 1);
-				if (i < 0) {
-					err(EX_OSERR, "could not write to STDIN.");
-				}
-			}
+	}
+	if ((size_t)n < len) {
+		if (queue_len(q) == 0)
+			st.shortwrites++;
+		queue_put(q, (const unsigned char *)p + n, len - n);
+	}
+	return 0;
+}
+
+/*
+ * queue_write() for a list of blocks.  With fd -1, they are only queued.
+ */
+static int
+queue_writev(struct queue *q, int fd, const struct iovec *iov, int cnt)
+{
+	size_t len = 0;
+	ssize_t n = 0;
+	int i;
+
+	if (fd != -1 && queue_len(q) == 0) {
+		do {
+			n = writev(fd, iov, cnt);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			n = 0;
 		}
+		for (i = 0; i < cnt; i++)
+			len += iov[i].iov_len;
+		if ((size_t)n < len)
+			st.shortwrites++;
 	}
-	return(0);
+	for (i = 0; i < cnt; i++) {
+		if ((size_t)n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			continue;
+		}
+		queue_put(q, (const unsigned char *)iov[i].iov_base + n,
+				iov[i].iov_len - n);
+		n = 0;
+	}
+	return 0;
 }
 
 
@@ -531,61 +793,4894 @@ modemcontrol(int sfd, int dtr)
 #endif
 }
 
-/**
- * parse a key sequence.
- * The string key_sequence is modified in place.
- * The string key_sequence may only contain hex-digits and white space.
- * It must have a length of at least 2 characters to parse a key.
- * @param[in,out] key_sequence string of hex-digits on input; binary values on output.
- * @return number of bytes parsed and converted in key_sequence.
+static void
+rtscontrol(int sfd, int rts)
+{
+#if defined(TIOCMBIS) && defined(TIOCM_RTS)
+	int flags = TIOCM_RTS;
+
+	ioctl(sfd, rts ? TIOCMBIS : TIOCMBIC, &flags);
+#endif
+}
+
+/*
+ * With the "rts" policy, deassert RTS when the output queue gets close to
+ * full so the device stops sending, and assert it again once the terminal
+ * has caught up.
  */
-static int
-parse_key_sequence(char *key_sequence)
+static void
+rtsupdate(int sfd, size_t fill, size_t size, int *off)
 {
-	int digits_read = 0;
-	unsigned char b = 0;
-	char *c;
-	int key_sequence_len = 0;
+	if (qpolicy != QPOLICY_RTS)
+		return;
+	if (!*off && fill >= size / 4 * 3) {
+		rtscontrol(sfd, 0);
+		*off = 1;
+		rtsthrottled++;
+	} else if (*off && fill <= size / 4) {
+		rtscontrol(sfd, 1);
+		*off = 0;
+	}
+}
 
-	if (key_sequence == NULL) {
-		return 0;
+
+#if defined(__linux__)
+/*
+ * Data from the serial device can be moved to stdout through a pipe with
+ * splice(2), so that it never enters a userspace buffer.  The pipe then
+ * takes the place of outq.  splicein() and spliceout() return the number
+ * of bytes moved, or -1 if splicing is not supported by one of the
+ * descriptors; in that case the data in the pipe is moved to outq, the
+ * pipe is closed and the caller falls back to read(2).
+ */
+static int spfd[2] = { -1, -1 };
+static size_t splicelen;
+
+static void
+spliceclose(void)
+{
+	unsigned char buf[RELAYBUFSIZE];
+	ssize_t n;
+
+	if (!qflag)
+		warnx("splice() not supported, using read()/write()\r");
+	while (splicelen > 0 && (n = read(spfd[0], buf, sizeof(buf))) > 0) {
+		queue_put(&outq, buf, n);
+		splicelen -= n;
 	}
+	close(spfd[0]);
+	close(spfd[1]);
+	spfd[0] = spfd[1] = -1;
+	splicelen = 0;
+}
 
-	for(c = key_sequence; *c; ++c) {
-		if (isspace(*c)) continue;
-		if (! isxdigit(*c)) {
-			fprintf(stderr, "invalid character in key sequence: %c (0x%02x)\n", *c, (int)*c);
-			return -1;
-		}
-		if (digits_read == 0) {
-			b = hex2dec(*c) << 4;
-		} else if (digits_read == 1) {
-			b |= hex2dec(*c);
-			key_sequence[key_sequence_len++] = b;
-			key_sequence[key_sequence_len] = 0;
-			b = 0;
+static ssize_t
+splicein(int sfd)
+{
+	unsigned char buf[RELAYBUFSIZE];
+	ssize_t n;
+
+	if (splicelen >= SPLICEMAX && qpolicy == QPOLICY_DROP) {
+		/* stdout is not keeping up: discard what is in the pipe */
+		while (splicelen > 0 && (n = read(spfd[0], buf, sizeof(buf))) > 0) {
+			outq.dropped += n;
+			splicelen -= n;
 		}
-		++digits_read;
-		digits_read &= 1;
 	}
-
-	return key_sequence_len;
+	if (splicelen >= SPLICEMAX)
+		return 0;
+	n = splice(sfd, NULL, spfd[1], NULL, SPLICEMAX - splicelen,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		if (errno != EINVAL && errno != ENOSYS)
+			err(EX_OSERR, "could not read from serial device.");
+		spliceclose();
+		return -1;
+	}
+	splicelen += n;
+	st.rxbytes += n;
+	st.rxchunks++;
+	return n;
 }
 
-/**
- * parse a key identifier into a key sequence.
- * @param key_id a key identifier.
- * @param[out] key_sequence will be set to an allocated array of bytes. The caller has to free the returned value.
- * @param[out] key_sequence_len size of key_sequence in bytes.
- * @return 0 if key_id is NULL;
- *         0 if key_id is a valid identifier, key_sequence and key_sequence_len are set;
- *        -1 if key_id is an invalid identifier;
- *        -2 upon parameter error.
- */
-static int
-parse_key_identifier(const char *key_id, char **key_sequence, int *key_sequence_len)
+static ssize_t
+spliceout(void)
 {
-	struct key_s {
+	ssize_t n;
+
+	if (splicelen == 0)
+		return 0;
+	n = splice(spfd[0], NULL, STDOUT_FILENO, NULL, splicelen,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		if (errno != EINVAL && errno != ENOSYS)
+			err(EX_OSERR, "could not write to STDOUT.");
+		spliceclose();
+		return -1;
+	}
+	splicelen -= n;
+	return n;
+}
+#endif
+
+
+/*
+ * Session log.  The relay loop only copies received data into a
+ * single-producer/single-consumer ring; a writer thread drains it to the
+ * log file in as large writes as have accumulated.  The loop never takes a
+ * lock unless the writer is asleep waiting for data.  Data that does not
+ * fit into the ring is counted and discarded.
+ */
+struct spsc {
+	unsigned char *buf;
+	size_t size;			/* a power of two */
+	atomic_size_t head;		/* advanced by the consumer */
+	atomic_size_t tail;		/* advanced by the producer */
+	atomic_int waiting;		/* threads blocked on cond */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	atomic_ullong dropped;		/* added to by the producer */
+};
+
+static void
+spsc_init(struct spsc *r, size_t size)
+{
+	r->size = 1;
+	while (r->size < size)
+		r->size <<= 1;
+	if ((r->buf = malloc(r->size)) == NULL)
+		err(EX_OSERR, "malloc(%zu)", r->size);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->waiting, 0);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	atomic_init(&r->dropped, 0);
+}
+
+static void
+spsc_wake(struct spsc *r)
+{
+	if (atomic_load(&r->waiting)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+/*
+ * Producer side: copy as much of p as fits, count the rest as dropped.
+ */
+static size_t
+spsc_put(struct spsc *r, const void *p, size_t len)
+{
+	size_t head, tail, off, n;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (len > r->size - (tail - head)) {
+		r->dropped += len - (r->size - (tail - head));
+		len = r->size - (tail - head);
+	}
+	off = tail & (r->size - 1);
+	n = r->size - off < len ? r->size - off : len;
+	memcpy(r->buf + off, p, n);
+	memcpy(r->buf, (const unsigned char *)p + n, len - n);
+	atomic_store(&r->tail, tail + len);
+	spsc_wake(r);
+	return len;
+}
+
+/*
+ * spsc_put() for a list of blocks, made visible to the consumer at once.
+ */
+static void
+spsc_putv(struct spsc *r, const struct iovec *iov, int cnt)
+{
+	size_t head, tail, room, off, n, len;
+	int i;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	room = r->size - (tail - head);
+	for (i = 0; i < cnt; i++) {
+		len = iov[i].iov_len;
+		if (len > room) {
+			r->dropped += len - room;
+			len = room;
+		}
+		off = tail & (r->size - 1);
+		n = r->size - off < len ? r->size - off : len;
+		memcpy(r->buf + off, iov[i].iov_base, n);
+		memcpy(r->buf, (const unsigned char *)iov[i].iov_base + n, len - n);
+		tail += len;
+		room -= len;
+	}
+	atomic_store(&r->tail, tail);
+	spsc_wake(r);
+}
+
+/*
+ * Consumer side: describe the readable part of the ring in at most two
+ * iovecs and return its length.
+ */
+static size_t
+spsc_peek(struct spsc *r, struct iovec iov[2])
+{
+	size_t head, len, off;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	len = atomic_load_explicit(&r->tail, memory_order_acquire) - head;
+	off = head & (r->size - 1);
+	iov[0].iov_base = r->buf + off;
+	iov[0].iov_len = r->size - off < len ? r->size - off : len;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return len;
+}
+
+static void
+spsc_consume(struct spsc *r, size_t len)
+{
+	atomic_fetch_add(&r->head, len);
+	spsc_wake(r);
+}
+
+#if !defined(HAS_BROKEN_POLL) || defined(UNITTEST)
+/*
+ * Producer side: describe the free part of the ring in at most two iovecs
+ * and return its length, for reading straight into the ring.  The data is
+ * handed to the consumer with spsc_commit().
+ */
+static size_t
+spsc_room(struct spsc *r, struct iovec iov[2])
+{
+	size_t tail, len, off;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	len = r->size - (tail - atomic_load_explicit(&r->head, memory_order_acquire));
+	off = tail & (r->size - 1);
+	iov[0].iov_base = r->buf + off;
+	iov[0].iov_len = r->size - off < len ? r->size - off : len;
+	iov[1].iov_base = r->buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return len;
+}
+
+static void
+spsc_commit(struct spsc *r, size_t len)
+{
+	atomic_fetch_add(&r->tail, len);
+	spsc_wake(r);
+}
+#endif
+
+/*
+ * Sleep until the ring is not empty (consumer) or not full (producer), *stop
+ * is set or the timeout (in milliseconds, -1 for none) expires.
+ */
+static void
+spsc_wait(struct spsc *r, atomic_int *stop, int ms)
+{
+	struct timespec ts;
+	size_t used;
+
+	pthread_mutex_lock(&r->lock);
+	atomic_fetch_add(&r->waiting, 1);
+	used = atomic_load(&r->tail) - atomic_load(&r->head);
+	if ((used == 0 || used == r->size) && !atomic_load(stop)) {
+		if (ms < 0) {
+			pthread_cond_wait(&r->cond, &r->lock);
+		} else {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += ms / 1000;
+			ts.tv_nsec += (ms % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&r->cond, &r->lock, &ts);
+		}
+	}
+	atomic_fetch_sub(&r->waiting, 1);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * A file written by its own thread from an spsc ring: the session log
+ * (-l) and the capture (-w).
+ */
+struct logger {
+	const char *what;
+	int fd;
+	struct spsc ring;
+	atomic_int stop;
+	pthread_t thread;
+	int running;
+};
+
+static struct logger sesslog = { "log", -1 };
+static struct logger caplog = { "capture", -1 };
+static int logsync = 0;		/* fsync() interval in seconds, 0 for none */
+
+static void *
+logwriter(void *arg)
+{
+	struct logger *l = arg;
+	struct iovec iov[2];
+	struct timespec now, synced;
+	size_t len;
+	ssize_t n;
+	int dirty = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &synced);
+	for (;;) {
+		len = spsc_peek(&l->ring, iov);
+		if (len > 0) {
+			n = writev(l->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				warn("write(%s)", l->what);
+				/* keep draining so the relay is not affected */
+				n = len;
+			}
+			spsc_consume(&l->ring, n);
+			dirty = 1;
+		}
+		if (dirty && logsync > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec - synced.tv_sec >= logsync) {
+				fsync(l->fd);
+				synced = now;
+				dirty = 0;
+			}
+		}
+		if (len == 0) {
+			if (atomic_load(&l->stop))
+				break;
+			spsc_wait(&l->ring, &l->stop, dirty && logsync > 0 ? logsync * 1000 : -1);
+		}
+	}
+	return NULL;
+}
+
+static int
+logopen(struct logger *l, const char *fn, int flags)
+{
+	int i;
+
+	if ((l->fd = open(fn, O_WRONLY | O_CREAT | flags, 0644)) < 0) {
+		warn("open %s", fn);
+		return -1;
+	}
+	spsc_init(&l->ring, LOGRINGSIZE);
+	atomic_init(&l->stop, 0);
+	if ((i = pthread_create(&l->thread, NULL, logwriter, l)) != 0) {
+		errno = i;
+		warn("pthread_create()");
+		close(l->fd);
+		l->fd = -1;
+		return -1;
+	}
+	l->running = 1;
+	return 0;
+}
+
+/*
+ * Stop the writer once it has written everything in the ring.  The file
+ * stays open.
+ */
+static void
+logstop(struct logger *l)
+{
+	if (!l->running)
+		return;
+	l->running = 0;
+	atomic_store(&l->stop, 1);
+	pthread_mutex_lock(&l->ring.lock);
+	pthread_cond_signal(&l->ring.cond);
+	pthread_mutex_unlock(&l->ring.lock);
+	pthread_join(l->thread, NULL);
+}
+
+static void
+logclose(struct logger *l)
+{
+	if (l->fd == -1)
+		return;
+	logstop(l);
+	if (logsync > 0)
+		fsync(l->fd);
+	close(l->fd);
+	l->fd = -1;
+	if (atomic_load(&l->ring.dropped) > 0)
+		fprintf(stderr, "%llu bytes not written to the %s because it did not keep up\n",
+				atomic_load(&l->ring.dropped), l->what);
+	free(l->ring.buf);
+}
+
+/*
+ * Threaded mode (--threads): a reader thread does nothing but move data
+ * from the serial device into thr.rx, so a slow terminal or log never
+ * keeps it from draining the UART.  The main thread handles the terminal
+ * and escapes, writes to the device and passes what was received through
+ * rx_tap() into thr.out, which a writer thread drains to stdout.
+ */
+static struct {
+	int enabled;
+	int cpu;		/* to pin the reader thread to, or -1 */
+	int sfd;
+	struct spsc rx;		/* reader thread -> main thread */
+	struct spsc out;	/* main thread -> writer thread */
+	int wake[2];		/* wakes the main thread */
+	int stoppipe[2];	/* stops the reader thread */
+	atomic_int rxready;	/* a wakeup for thr.rx is pending */
+	atomic_int stalled;	/* main thread waits for room in thr.out */
+	atomic_int rxstop, outstop;
+	atomic_int rxerr;	/* errno of the reader, -1 for a hangup */
+	atomic_int outerr;	/* errno of the writer */
+	atomic_ullong shortwrites;	/* of the writer, apart from st's */
+	pthread_t rxthread, outthread;
+} thr = { 0, -1, -1, .wake = { -1, -1 }, .stoppipe = { -1, -1 } };
+
+/*
+ * Capture (-w): every chunk of data sent or received becomes a record in
+ * the format described in sccap.h.  Records that don't fit into the ring
+ * are dropped as a whole, so the offsets in the index stay valid.
+ */
+static struct sccap_index capidx;
+static uint64_t capoff;		/* offset of the next record */
+static uint64_t captime;	/* time of the last record */
+
+static int
+capopen(const char *fn)
+{
+	unsigned char hdr[SCCAP_HDRSIZE];
+
+	if (logopen(&caplog, fn, O_TRUNC) < 0)
+		return -1;
+	captime = sccap_now();
+	sccap_puthdr(hdr, captime);
+	spsc_put(&caplog.ring, hdr, sizeof(hdr));
+	capoff = sizeof(hdr);
+	return 0;
+}
+
+static void
+capture(int type, const void *p, size_t len)
+{
+	unsigned char hdr[SCCAP_RECSIZE];
+	struct sccap_rec r;
+	size_t space;
+
+	if (caplog.fd == -1)
+		return;
+	space = caplog.ring.size - (atomic_load(&caplog.ring.tail) -
+			atomic_load(&caplog.ring.head));
+	if (space < sizeof(hdr) + len) {
+		caplog.ring.dropped += len;
+		return;
+	}
+	r.time = captime = sccap_now();
+	r.len = len;
+	r.type = type;
+	if (sccap_index_add(&capidx, r.time, capoff) < 0)
+		warn("capture index");
+	sccap_putrec(hdr, &r);
+	spsc_put(&caplog.ring, hdr, sizeof(hdr));
+	if (len > 0)
+		spsc_put(&caplog.ring, p, len);
+	capoff += sizeof(hdr) + len;
+}
+
+/*
+ * Write out the capture and append the time index.
+ */
+static void
+capclose(void)
+{
+	if (caplog.fd == -1)
+		return;
+	logstop(&caplog);
+	if (sccap_index_write(caplog.fd, &capidx, capoff, captime) < 0)
+		warn("write(capture index)");
+	sccap_index_free(&capidx);
+	logclose(&caplog);
+}
+
+/*
+ * Hexdump view (~h, --imap hex): the data from the device, and the data
+ * sent to it, as lines like those of hexdump -C.  Each line has a
+ * direction marker, the offset in that direction, and up to 16 bytes in
+ * hex and as characters:
+ *
+ * < 00000040  48 65 6c 6c 6f 0d 0a                               |Hello..|
+ *
+ * Every block read starts a new line, so data shows as soon as it comes
+ * in, and the way the device split it up is visible.  Bytes sent are
+ * collected until the end of each block of input.  The lines are built
+ * from tables of hex pairs and printable characters, without printf().
+ */
+#define HEXLINEMAX	82
+
+static struct {
+	int on;			/* show the data sent */
+	uint64_t txoff;
+	unsigned char tx[16];	/* sent, not shown yet */
+	size_t txlen;
+} hexview;
+
+static char hexpair[256][2];
+static char hexchar[256];
+
+static void
+hexinit(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		hexpair[i][0] = digits[i >> 4];
+		hexpair[i][1] = digits[i & 15];
+		hexchar[i] = i >= ' ' && i < 0x7f ? i : '.';
+	}
+}
+
+/*
+ * Format the n (up to 16) bytes at p, found at offset off, into line.
+ * Returns the length of the line.
+ */
+static size_t
+hexline(char *line, char dir, uint64_t off, const unsigned char *p, size_t n)
+{
+	char *o;
+	size_t i;
+
+	memset(line, ' ', 62);
+	line[0] = dir;
+	for (i = 0; i < 4; i++)
+		memcpy(line + 2 + 2 * i, hexpair[(off >> (24 - 8 * i)) & 0xff], 2);
+	for (i = 0; i < n; i++)
+		memcpy(line + 12 + 3 * i + (i >= 8), hexpair[p[i]], 2);
+	o = line + 62;
+	*o++ = '|';
+	for (i = 0; i < n; i++)
+		*o++ = hexchar[p[i]];
+	*o++ = '|';
+	*o++ = '\r';
+	*o++ = '\n';
+	return o - line;
+}
+
+/* room for hexdump lines on the way to the terminal */
+static size_t
+hexspace(void)
+{
+	if (thr.out.buf != NULL)
+		return thr.out.size - (atomic_load(&thr.out.tail) -
+				atomic_load(&thr.out.head));
+	return queue_space(&outq);
+}
+
+/*
+ * Show the bytes sent that are not shown yet.  Unless old output may be
+ * dropped, a line that does not fit is left out and counted as dropped
+ * rather than overwrite output not shown yet; the terminal is only read
+ * while there is room for the lines of what is typed, see consoleroom().
+ */
+static void
+hexsent(void)
+{
+	char line[HEXLINEMAX];
+	size_t len;
+
+	if (hexview.txlen == 0)
+		return;
+	len = hexline(line, '>', hexview.txoff, hexview.tx, hexview.txlen);
+	hexview.txoff += hexview.txlen;
+	hexview.txlen = 0;
+	if (thr.out.buf != NULL && hexspace() < len)
+		thr.out.dropped += len;
+	else if (thr.out.buf != NULL)
+		spsc_put(&thr.out, line, len);
+	else if (qpolicy != QPOLICY_DROP && hexspace() < len)
+		outq.dropped += len;
+	else
+		queue_put(&outq, line, len);
+}
+
+/*
+ * Everything sent to the serial device passes here: the capture, the
+ * statistics and the hexdump view.
+ */
+static void
+tx_tap(const void *p, size_t len)
+{
+	const unsigned char *s = p;
+	size_t n;
+
+	capture(SCCAP_TX, p, len);
+	st.txbytes += len;
+	if (!hexview.on)
+		return;
+	for (; len > 0; s += n, len -= n) {
+		n = sizeof(hexview.tx) - hexview.txlen;
+		if (n > len)
+			n = len;
+		memcpy(hexview.tx + hexview.txlen, s, n);
+		if ((hexview.txlen += n) == sizeof(hexview.tx))
+			hexsent();
+	}
+}
+
+
+/*
+ * Transmit pacing for devices that cannot keep up with a paste at line
+ * speed: a delay after each newline (-d), between bytes (--char-delay)
+ * and a cap on bytes per second (--tx-rate).  serq is written only up to
+ * the next limit and the main loop sleeps in poll() until the deadline,
+ * so the device is still read in the meantime.
+ */
+#define PACESLACK	1000000ULL	/* ns of unused rate allowance kept */
+
+static struct {
+	uint64_t nldelay;	/* ns after each '\n' */
+	uint64_t chardelay;	/* ns between bytes */
+	uint64_t bytecost;	/* ns per byte for --tx-rate */
+	uint64_t next;		/* nothing is sent before this time */
+} pace;
+
+#define pacing()	(pace.nldelay > 0 || pace.chardelay > 0 || pace.bytecost > 0)
+
+/*
+ * Write serq to the serial device as far as the pacing limits allow.
+ */
+static int
+txflush(int sfd)
+{
+	uint64_t now;
+	size_t n, head;
+	ssize_t nl;
+
+	if (!pacing())
+		return queue_flush(&serq, sfd);
+	if (queue_len(&serq) == 0 || (now = nsnow()) < pace.next)
+		return 0;
+	n = pace.chardelay > 0 ? 1 : queue_len(&serq);
+	if (pace.bytecost > 0) {
+		if (pace.next + PACESLACK < now)
+			pace.next = now - PACESLACK;
+		if (n > (now - pace.next) / pace.bytecost + 1)
+			n = (now - pace.next) / pace.bytecost + 1;
+	}
+	if (pace.nldelay > 0 && (nl = queue_find(&serq, '\n', n)) >= 0)
+		n = nl + 1;
+	head = serq.head;
+	if (queue_flushn(&serq, sfd, n) < 0)
+		return -1;
+	if ((n = serq.head - head) == 0)
+		return 0;
+	pace.next += n * pace.bytecost;
+	if (pace.chardelay > 0 && pace.next < now + pace.chardelay)
+		pace.next = now + pace.chardelay;
+	if (pace.nldelay > 0 && serq.buf[(serq.head - 1) & (serq.size - 1)] == '\n' &&
+			pace.next < now + pace.nldelay)
+		pace.next = now + pace.nldelay;
+	return 0;
+}
+
+/*
+ * Milliseconds until txflush() can send more: -1 if serq is empty, 0 if
+ * right away.
+ */
+static int
+txwait(void)
+{
+	uint64_t now;
+
+	if (queue_len(&serq) == 0)
+		return -1;
+	if (!pacing() || (now = nsnow()) >= pace.next)
+		return 0;
+	return (pace.next - now + 999999) / 1000000;
+}
+
+/*
+ * Send everything in serq, sleeping through the pacing delays.  With a
+ * timeout of ms milliseconds (-1 for none), also wait for the device to
+ * take what the driver holds.  Gives up at the timeout or when a signal
+ * asked sc to stop.  Returns 0 when done, 1 if it gave up, -1 on an error.
+ */
+static int
+txdrain(int sfd, int ms)
+{
+	struct pollfd pfd;
+	uint64_t now, deadline;
+	int wait, left, pending;
+
+	deadline = ms < 0 ? 0 : nsnow() + ms * 1000000ULL;
+	while (!gotsig) {
+		if (txwait() == 0 && txflush(sfd) < 0)
+			return -1;
+		if ((wait = txwait()) < 0) {
+#if defined(TIOCOUTQ)
+			if (deadline == 0 || ioctl(sfd, TIOCOUTQ, &pending) < 0 ||
+					pending == 0)
+				return 0;
+			wait = 10;
+#else
+			return 0;
+#endif
+		}
+		pfd.fd = sfd;
+		pfd.events = wait == 0 ? POLLOUT : 0;
+		pfd.revents = 0;
+		if (wait == 0)
+			wait = -1;
+		if (deadline != 0) {
+			if ((now = nsnow()) >= deadline)
+				return 1;
+			left = (deadline - now + 999999) / 1000000;
+			if (wait < 0 || wait > left)
+				wait = left;
+		}
+		if (poll(&pfd, 1, wait) < 0 && errno != EINTR)
+			return -1;
+	}
+	return 1;
+}
+/*
+ * Key sequences sent on a schedule (-k, -K): each one every interval,
+ * counted from when the connection is made rather than from the last
+ * wakeup, so that traffic from the device does not hold it back.
+ */
+#define MAXKEYSCHEDS	16
+
+struct keysched {
+	const char *seq;
+	int len;
+	uint64_t interval;	/* ns */
+	unsigned long count;	/* times left to send, 0 for no limit */
+	uint64_t duration;	/* ns to keep sending, 0 for no limit */
+	uint64_t next;		/* when it is due */
+	uint64_t until;
+};
+
+static struct keysched keyscheds[MAXKEYSCHEDS];
+static int nkeyscheds;
+
+static void
+keystart(void)
+{
+	uint64_t now = nsnow();
+	int i;
+
+	for (i = 0; i < nkeyscheds; i++) {
+		keyscheds[i].next = now + keyscheds[i].interval;
+		keyscheds[i].until = keyscheds[i].duration > 0 ? now + keyscheds[i].duration : 0;
+	}
+}
+
+static void
+keystop(void)
+{
+	nkeyscheds = 0;
+}
+
+/*
+ * Milliseconds until the next key sequence is due, -1 if there is none.
+ */
+static int
+keywait(void)
+{
+	uint64_t now, next = 0;
+	int i;
+
+	for (i = 0; i < nkeyscheds; i++) {
+		if (keyscheds[i].len > 0 && (next == 0 || keyscheds[i].next < next))
+			next = keyscheds[i].next;
+	}
+	if (next == 0)
+		return -1;
+	if ((now = nsnow()) >= next)
+		return 0;
+	return (next - now + 999999) / 1000000;
+}
+
+/*
+ * Queue the key sequences that are due.  Returns how many were queued.
+ */
+static int
+keysend(void)
+{
+	struct keysched *k;
+	uint64_t now = nsnow();
+	int i, n = 0;
+
+	for (i = 0; i < nkeyscheds; i++) {
+		k = &keyscheds[i];
+		if (k->len == 0 || now < k->next)
+			continue;
+		if (k->until != 0 && now >= k->until) {
+			k->len = 0;
+			continue;
+		}
+		/* skip a turn rather than push out data that is still queued */
+		if (queue_space(&serq) >= (size_t)k->len) {
+			tx_tap(k->seq, k->len);
+			hexsent();
+			st.txchunks++;
+			queue_put(&serq, k->seq, k->len);
+			n++;
+			if (k->count > 0 && --k->count == 0)
+				k->len = 0;
+		}
+		while (k->next <= now)
+			k->next += k->interval;
+	}
+	return n;
+}
+/*
+ * Expect rules (--expect, --expect-file): whenever a pattern shows up in
+ * the output of the device, a response is sent to it.  All patterns are
+ * matched at once by an Aho-Corasick automaton, compiled into a DFA over
+ * the classes of bytes that occur in the patterns, so the cost per byte is
+ * one table lookup however many rules there are.  The state carries over
+ * from one read to the next, so a pattern split between reads matches.
+ */
+struct rule {
+	unsigned char *pattern;
+	size_t patlen;
+	char *resp;
+	int resplen;
+	int same;		/* next rule with the same pattern, or -1 */
+	int pending;		/* responses owed, matched while serq was full */
+	unsigned long long hits;
+};
+
+static struct {
+	struct rule *rules;
+	int nrules;
+	unsigned char cls[256];	/* byte -> class, 0 for bytes in no pattern */
+	uint32_t ncls;
+	uint32_t *delta;	/* next state, [state * ncls + class] */
+	int *out;		/* first rule whose pattern ends here, or -1 */
+	uint32_t *dict;		/* longest proper suffix state with a rule, or 0 */
+	unsigned char *term;	/* out or dict set: check for matches */
+	uint32_t nstates;
+	uint32_t state;
+	int npending;		/* rules with responses pending */
+} ac;
+
+static int
+expectbuild(void)
+{
+	uint32_t *fail, *bfs, s, r, f, c, ncls = 1, qh = 0, qt = 0;
+	size_t j, total = 1;
+	int i;
+
+	memset(ac.cls, 0, sizeof(ac.cls));
+	for (i = 0; i < ac.nrules; i++) {
+		total += ac.rules[i].patlen;
+		for (j = 0; j < ac.rules[i].patlen; j++) {
+			if (ac.cls[ac.rules[i].pattern[j]] == 0)
+				ac.cls[ac.rules[i].pattern[j]] = ncls++;
+		}
+	}
+	if (total > UINT32_MAX / ncls) {
+		warnx("too many expect patterns");
+		return -1;
+	}
+	ac.ncls = ncls;
+	ac.delta = calloc(total * ncls, sizeof(*ac.delta));
+	ac.out = malloc(total * sizeof(*ac.out));
+	ac.dict = calloc(total, sizeof(*ac.dict));
+	ac.term = calloc(total, 1);
+	fail = calloc(total, sizeof(*fail));
+	bfs = malloc(total * sizeof(*bfs));
+	if (ac.delta == NULL || ac.out == NULL || ac.dict == NULL ||
+			ac.term == NULL || fail == NULL || bfs == NULL) {
+		warn("expect automaton");
+		free(fail);
+		free(bfs);
+		return -1;
+	}
+	for (j = 0; j < total; j++)
+		ac.out[j] = -1;
+
+	/* the trie; 0 is the root and, while building, "no edge" */
+	ac.nstates = 1;
+	for (i = 0; i < ac.nrules; i++) {
+		struct rule *rl = &ac.rules[i];
+
+		for (s = 0, j = 0; j < rl->patlen; j++) {
+			uint32_t *d = &ac.delta[s * ncls + ac.cls[rl->pattern[j]]];
+
+			if (*d == 0)
+				*d = ac.nstates++;
+			s = *d;
+		}
+		rl->same = ac.out[s];
+		ac.out[s] = i;
+		ac.term[s] = 1;
+	}
+
+	/* failure links breadth first, filling in the missing edges */
+	for (c = 0; c < ncls; c++) {
+		if ((s = ac.delta[c]) != 0)
+			bfs[qt++] = s;
+	}
+	while (qh < qt) {
+		r = bfs[qh++];
+		for (c = 0; c < ncls; c++) {
+			s = ac.delta[r * ncls + c];
+			f = ac.delta[fail[r] * ncls + c];
+			if (s == 0) {
+				ac.delta[r * ncls + c] = f;
+				continue;
+			}
+			fail[s] = f;
+			ac.dict[s] = ac.out[f] >= 0 ? f : ac.dict[f];
+			if (ac.dict[s] != 0)
+				ac.term[s] = 1;
+			bfs[qt++] = s;
+		}
+	}
+	free(fail);
+	free(bfs);
+	ac.state = 0;
+	return 0;
+}
+
+#if defined(UNITTEST)
+static void
+expectfree(void)
+{
+	int i;
+
+	for (i = 0; i < ac.nrules; i++) {
+		free(ac.rules[i].pattern);
+		free(ac.rules[i].resp);
+	}
+	free(ac.rules);
+	free(ac.delta);
+	free(ac.out);
+	free(ac.dict);
+	free(ac.term);
+	memset(&ac, 0, sizeof(ac));
+}
+#endif
+
+/*
+ * Queue the response of rl.  While serq has no room for it, e.g. during a
+ * paste, it is held back and sent by expectretry() once there is.
+ */
+static int
+expectsend(struct rule *rl)
+{
+	if (queue_space(&serq) < (size_t)rl->resplen)
+		return 0;
+	rl->hits++;
+	tx_tap(rl->resp, rl->resplen);
+	hexsent();
+	st.txchunks++;
+	queue_put(&serq, rl->resp, rl->resplen);
+	if (!qflag)
+		fprintf(stderr, "->matched \"%.*s\", sent %d bytes<-\r\n",
+				(int)rl->patlen, rl->pattern, rl->resplen);
+	return 1;
+}
+
+static void
+expectfire(struct rule *rl)
+{
+	if (rl->pending == 0 && expectsend(rl))
+		return;
+	if (rl->pending++ == 0)
+		ac.npending++;
+	if (!qflag)
+		fprintf(stderr, "->matched \"%.*s\", no room to send yet<-\r\n",
+				(int)rl->patlen, rl->pattern);
+}
+
+/*
+ * Send the responses held back for lack of room, in the order of the
+ * rules.  Returns how many were queued.
+ */
+static int
+expectretry(void)
+{
+	struct rule *rl;
+	int n = 0;
+
+	if (ac.npending == 0)
+		return 0;
+	for (rl = ac.rules; rl < ac.rules + ac.nrules; rl++) {
+		while (rl->pending > 0 && expectsend(rl)) {
+			n++;
+			if (--rl->pending == 0)
+				ac.npending--;
+		}
+	}
+	return n;
+}
+
+/*
+ * Run output from the device through the automaton and queue the
+ * responses of the rules that match.  Returns how many matched.
+ */
+static int
+expectscan(const unsigned char *buf, size_t len)
+{
+	const uint32_t *delta = ac.delta;
+	const unsigned char *cls = ac.cls;
+	const unsigned char *end = buf + len;
+	uint32_t s = ac.state, m, ncls = ac.ncls;
+	int i, n = 0;
+
+	for (; buf < end; buf++) {
+		s = delta[s * ncls + cls[*buf]];
+		if (!ac.term[s])
+			continue;
+		for (m = ac.out[s] >= 0 ? s : ac.dict[s]; m != 0; m = ac.dict[m]) {
+			for (i = ac.out[m]; i >= 0; i = ac.rules[i].same) {
+				expectfire(&ac.rules[i]);
+				n++;
+			}
+		}
+	}
+	ac.state = s;
+	return n;
+}
+
+/*
+ * Scrollback (--history): everything received from the device is kept in
+ * memory, to be searched with the ~/ and ~r escapes.  It is stored in
+ * chunks taken from a pool that grows up to the configured size; after
+ * that the oldest chunk is recycled.  A line is only split between chunks
+ * if it is longer than a quarter chunk, so each chunk can be searched as
+ * a single block, with memmem() or regexec().
+ */
+#define HISTCHUNK	(1024 * 1024)
+#define HISTCONTEXT	2	/* lines shown before and after a match */
+#define HISTSHOW	20	/* matches shown, the most recent ones */
+
+struct histchunk {
+	struct histchunk *next;	/* the next newer chunk */
+	size_t len;
+	unsigned char data[HISTCHUNK];
+};
+
+static struct {
+	struct histchunk *oldest, *newest;
+	size_t nchunks, maxchunks;
+	size_t kept;			/* bytes in all chunks */
+	unsigned long long dropped;	/* bytes recycled */
+	const char *pat;
+	size_t patlen;
+	regex_t re;
+	int isre;
+} history;
+
+static void
+historyinit(size_t size)
+{
+	history.maxchunks = 0;
+	if (size > 0)
+		history.maxchunks = (size + HISTCHUNK - 1) / HISTCHUNK < 2 ?
+				2 : (size + HISTCHUNK - 1) / HISTCHUNK;
+}
+
+#if defined(UNITTEST)
+static void
+historyfree(void)
+{
+	struct histchunk *c;
+
+	while ((c = history.oldest) != NULL) {
+		history.oldest = c->next;
+		free(c);
+	}
+	memset(&history, 0, sizeof(history));
+}
+#endif
+
+/*
+ * Start a new chunk after prev, carrying over the unfinished line at its
+ * end.  Returns NULL if there is no memory for the first chunks.
+ */
+static struct histchunk *
+historychunk(struct histchunk *prev)
+{
+	struct histchunk *c;
+	size_t nl;
+
+	if (history.nchunks < history.maxchunks &&
+			(c = malloc(sizeof(*c))) != NULL) {
+		history.nchunks++;
+	} else if (history.nchunks >= 2) {
+		c = history.oldest;
+		history.oldest = c->next;
+		history.dropped += c->len;
+		history.kept -= c->len;
+	} else {
+		return NULL;
+	}
+	c->next = NULL;
+	c->len = 0;
+	if (prev == NULL) {
+		history.oldest = c;
+	} else {
+		prev->next = c;
+		for (nl = prev->len; nl > 0 && prev->data[nl - 1] != '\n'; nl--) {
+			if (prev->len - nl >= HISTCHUNK / 4)
+				break;
+		}
+		if (nl > 0 && prev->data[nl - 1] == '\n') {
+			c->len = prev->len - nl;
+			memcpy(c->data, prev->data + nl, c->len);
+			prev->len = nl;
+		}
+	}
+	history.newest = c;
+	return c;
+}
+
+static void
+historyadd(const unsigned char *buf, size_t len)
+{
+	struct histchunk *c = history.newest;
+	size_t n;
+
+	while (len > 0) {
+		if (c == NULL || c->len == HISTCHUNK) {
+			if ((c = historychunk(c)) == NULL)
+				return;
+		}
+		n = HISTCHUNK - c->len < len ? HISTCHUNK - c->len : len;
+		memcpy(c->data + c->len, buf, n);
+		c->len += n;
+		history.kept += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* start of the line lines before the one containing off */
+static size_t
+historybol(const struct histchunk *c, size_t off, int lines)
+{
+	for (; off > 0; off--) {
+		if (c->data[off - 1] == '\n' && lines-- == 0)
+			break;
+	}
+	return off;
+}
+
+/* end, past the '\n', of the line lines after the one containing off */
+static size_t
+historyeol(const struct histchunk *c, size_t off, int lines)
+{
+	const unsigned char *p;
+
+	do {
+		p = memchr(c->data + off, '\n', c->len - off);
+		off = p != NULL ? p - c->data + 1 : c->len;
+	} while (lines-- > 0 && off < c->len);
+	return off;
+}
+
+/* offset of the next match in c at or after off, or -1 */
+static ssize_t
+historymatch(const struct histchunk *c, size_t off)
+{
+	const unsigned char *p;
+	regmatch_t m;
+
+	if (history.isre) {
+		m.rm_so = off;
+		m.rm_eo = c->len;
+		if (regexec(&history.re, (const char *)c->data, 1, &m, REG_STARTEND) != 0)
+			return -1;
+		return m.rm_so;
+	}
+	p = memmem(c->data + off, c->len - off, history.pat, history.patlen);
+	return p != NULL ? p - c->data : -1;
+}
+
+struct histmark {
+	const struct histchunk *c;
+	size_t bol;
+};
+
+/*
+ * Find the lines matching the current pattern.  Returns how many there
+ * are; the last nmarks of them are left in marks, as a ring indexed by
+ * the match number.
+ */
+static unsigned long long
+historyfind(struct histmark *marks, int nmarks)
+{
+	const struct histchunk *c;
+	unsigned long long n = 0;
+	size_t off;
+	ssize_t m;
+
+	for (c = history.oldest; c != NULL; c = c->next) {
+		for (off = 0; off < c->len && (m = historymatch(c, off)) >= 0; n++) {
+			marks[n % nmarks].c = c;
+			marks[n % nmarks].bol = historybol(c, m, 0);
+			off = historyeol(c, m, 0);
+		}
+	}
+	return n;
+}
+
+/* print the lines in c from off to end, marking the one at match */
+static void
+historyprint(const struct histchunk *c, size_t off, size_t end, size_t match)
+{
+	size_t eol, len;
+
+	for (; off < end; off = eol) {
+		eol = historyeol(c, off, 0);
+		len = eol - off;
+		while (len > 0 && (c->data[off + len - 1] == '\n' ||
+				c->data[off + len - 1] == '\r'))
+			len--;
+		fputs(off == match ? "> " : "  ", stderr);
+		fwrite(c->data + off, 1, len, stderr);
+		fputs("\r\n", stderr);
+	}
+}
+
+/*
+ * Search the scrollback for pat, a string or, if re is set, an extended
+ * regular expression, and show the last matching lines with some lines of
+ * context around them.  Context does not reach into other chunks.
+ */
+static void
+historysearch(const char *pat, int re)
+{
+	struct histmark marks[HISTSHOW];
+	const struct histmark *mk, *next;
+	unsigned long long n, i;
+	size_t start, end, shown = 0;
+	const struct histchunk *c = NULL;
+	uint64_t t = nsnow();
+	int fl, rv;
+
+	if (history.maxchunks == 0) {
+		fprintf(stderr, "->no scrollback kept<-\r\n");
+		return;
+	}
+	history.isre = re;
+	history.pat = pat;
+	history.patlen = strlen(pat);
+	if (re && (rv = regcomp(&history.re, pat, REG_EXTENDED | REG_NEWLINE)) != 0) {
+		char msg[128];
+
+		regerror(rv, &history.re, msg, sizeof(msg));
+		fprintf(stderr, "->%s<-\r\n", msg);
+		return;
+	}
+
+	/* there may be more than the terminal takes at once */
+	fl = fcntl(STDERR_FILENO, F_GETFL);
+	if (fl != -1)
+		fcntl(STDERR_FILENO, F_SETFL, fl & ~O_NONBLOCK);
+	n = historyfind(marks, HISTSHOW);
+	t = nsnow() - t;
+	for (i = n > HISTSHOW ? n - HISTSHOW : 0; i < n; i++) {
+		mk = &marks[i % HISTSHOW];
+		next = i + 1 < n ? &marks[(i + 1) % HISTSHOW] : NULL;
+		start = historybol(mk->c, mk->bol, HISTCONTEXT);
+		if (mk->c != c || start > shown) {
+			if (c != NULL)
+				fputs("--\r\n", stderr);
+			c = mk->c;
+		} else {
+			start = shown;
+		}
+		end = historyeol(mk->c, mk->bol, HISTCONTEXT);
+		if (next != NULL && next->c == c && next->bol < end)
+			end = next->bol;
+		historyprint(c, start, end, mk->bol);
+		shown = end;
+	}
+	fprintf(stderr, "->%llu matching lines", n);
+	if (n > HISTSHOW)
+		fprintf(stderr, ", showing the last %d", HISTSHOW);
+	fprintf(stderr, " (%.1f MB searched in %.3f s)<-\r\n",
+			history.kept / (1024.0 * 1024), t / 1e9);
+	fflush(stderr);
+	if (fl != -1)
+		fcntl(STDERR_FILENO, F_SETFL, fl);
+	if (re)
+		regfree(&history.re);
+}
+
+/*
+ * Send a block to the serial device, straight away if it takes it and no
+ * pacing is in effect.
+ */
+static void
+txwrite(int sfd, const void *p, size_t len)
+{
+	tx_tap(p, len);
+	if (pacing()) {
+		queue_put(&serq, p, len);
+	} else if (queue_write(&serq, sfd, p, len) < 0) {
+		err(EX_OSERR, "could not write to serial device.");
+	}
+}
+
+static void
+txbreak(int sfd)
+{
+	tcsendbreak(sfd, 0);
+	capture(SCCAP_BREAK, NULL, 0);
+	st.breaks++;
+}
+
+/*
+ * Transforms (--imap, --omap, --logmap): a chain of stages for the data
+ * going to the terminal, to the device or to the log.  A stage finds the
+ * bytes it changes a span at a time and hands the spans in between to the
+ * next stage as they are, pointing into the buffer they came in; only what
+ * it makes up itself is put into its own small buffer.  The end of the
+ * chain collects the spans in an iovec array, and a sink takes them all
+ * at once, usually with a single writev().  Stages must not keep pointers
+ * to their input, so a stage reusing its buffer first flushes the chain.
+ */
+#define XFMAX		8	/* stages per chain */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define XFIOVMAX	IOV_MAX
+#else
+#define XFIOVMAX	1024	/* spans collected before they go to the sink */
+#endif
+#define XFBUFSIZE	4096
+#define TSLEN		24	/* "YYYY-MM-DD HH:MM:SS.mmm " */
+
+struct xchain;
+
+struct xstage {
+	void (*fn)(struct xstage *x, const unsigned char *p, size_t len);
+	struct xchain *chain;
+	unsigned char from;	/* the byte a map stage replaces */
+	const char *to;		/* and what with */
+	size_t tolen;
+	int state;
+	int grow;
+	uint64_t count;		/* bytes seen, for hex */
+	size_t used;		/* of buf */
+	unsigned char buf[XFBUFSIZE];
+};
+
+struct xchain {
+	int grow;		/* most bytes out per byte in */
+	int n;
+	struct xstage stage[XFMAX];
+	struct iovec iov[XFIOVMAX];
+	int niov;
+	void (*sink)(const struct iovec *iov, int n, int fd);
+	int fd;
+};
+
+static struct xchain imap = { .grow = 1 }, omap = { .grow = 1 },
+		logmap = { .grow = 1 };
+
+static void
+xfflush(struct xchain *c)
+{
+	if (c->niov > 0)
+		c->sink(c->iov, c->niov, c->fd);
+	c->niov = 0;
+}
+
+/*
+ * Pass a span on to the next stage, or queue it for the sink, joined to
+ * the previous one if it continues it.
+ */
+static void
+xfemit(struct xstage *x, const void *p, size_t len)
+{
+	struct xchain *c = x->chain;
+	struct iovec *v;
+
+	if (len == 0)
+		return;
+	if (++x < c->stage + c->n) {
+		x->fn(x, p, len);
+		return;
+	}
+	if (c->niov > 0) {
+		v = &c->iov[c->niov - 1];
+		if ((const unsigned char *)v->iov_base + v->iov_len == p) {
+			v->iov_len += len;
+			return;
+		}
+	}
+	if (c->niov == XFIOVMAX)
+		xfflush(c);
+	c->iov[c->niov].iov_base = (void *)p;
+	c->iov[c->niov++].iov_len = len;
+}
+
+/*
+ * Room for len bytes in the buffer of x, taken with x->used += len.  When
+ * the buffer is full, the spans still pointing into it go out first.
+ */
+static unsigned char *
+xfbuf(struct xstage *x, size_t len)
+{
+	if (x->used + len > sizeof(x->buf)) {
+		xfflush(x->chain);
+		x->used = 0;
+	}
+	return x->buf + x->used;
+}
+
+/*
+ * Run len bytes through the chain c and hand the result to sink, with fd
+ * passed on.
+ */
+static void
+xfrun(struct xchain *c, const unsigned char *p, size_t len,
+		void (*sink)(const struct iovec *, int, int), int fd)
+{
+	int i;
+
+	c->sink = sink;
+	c->fd = fd;
+	c->stage[0].fn(&c->stage[0], p, len);
+	xfflush(c);
+	for (i = 0; i < c->n; i++)
+		c->stage[i].used = 0;
+}
+
+/* crlf, lfcrlf, igncr and the like: replace one byte with 0 to 2 */
+static void
+xfmap(struct xstage *x, const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len, *q;
+
+	while (p < end) {
+		if ((q = memchr(p, x->from, end - p)) == NULL)
+			q = end;
+		xfemit(x, p, q - p);
+		if (q == end)
+			break;
+		xfemit(x, x->to, x->tolen);
+		p = q + 1;
+	}
+}
+
+/* 7bit: clear the top bit; spans of ASCII are found a word at a time */
+static void
+xf7bit(struct xstage *x, const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len, *q = p;
+	unsigned char *b;
+	uint64_t w;
+	size_t n;
+
+	while (q < end) {
+		while (end - q >= 8) {
+			memcpy(&w, q, 8);
+			if (w & 0x8080808080808080ULL)
+				break;
+			q += 8;
+		}
+		while (q < end && *q < 0x80)
+			q++;
+		xfemit(x, p, q - p);
+		for (p = q; q < end && *q >= 0x80; q++)
+			;
+		if ((n = q - p) > sizeof(x->buf))
+			n = sizeof(x->buf);
+		q = p + n;
+		if (n > 0) {
+			b = xfbuf(x, n);
+			x->used += n;
+			for (; p < q; p++)
+				*b++ = *p & 0x7f;
+			xfemit(x, b - n, n);
+		}
+	}
+}
+
+/*
+ * ansi: drop escape sequences, CSI (ESC [ ... final), the string types
+ * (ESC ] ... BEL or ESC \, also P, X, ^ and _), character set selection
+ * (ESC ( x and friends) and the two byte ones.  They may be split between
+ * reads.
+ */
+enum { ANSI_TEXT, ANSI_ESC, ANSI_CSI, ANSI_STR, ANSI_STRESC, ANSI_CHARSET };
+
+static void
+xfansi(struct xstage *x, const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len, *q;
+	unsigned char c;
+
+	while (p < end) {
+		if (x->state == ANSI_TEXT) {
+			if ((q = memchr(p, 0x1b, end - p)) == NULL)
+				q = end;
+			xfemit(x, p, q - p);
+			if (q == end)
+				break;
+			x->state = ANSI_ESC;
+			p = q + 1;
+			continue;
+		}
+		c = *p++;
+		switch (x->state) {
+			case ANSI_ESC:
+				if (c == '[')
+					x->state = ANSI_CSI;
+				else if (c == ']' || c == 'P' || c == 'X' ||
+						c == '^' || c == '_')
+					x->state = ANSI_STR;
+				else if (c >= ' ' && c <= '/')
+					x->state = ANSI_CHARSET;
+				else if (c != 0x1b)
+					x->state = ANSI_TEXT;
+				break;
+			case ANSI_CSI:
+				if (c < ' ' || c > '?')
+					x->state = ANSI_TEXT;
+				break;
+			case ANSI_STR:
+				if (c == 0x07)
+					x->state = ANSI_TEXT;
+				else if (c == 0x1b)
+					x->state = ANSI_STRESC;
+				break;
+			case ANSI_STRESC:
+				x->state = c == 0x1b ? ANSI_STRESC : c == '\\' ?
+						ANSI_TEXT : ANSI_STR;
+				break;
+			case ANSI_CHARSET:
+				x->state = ANSI_TEXT;
+				break;
+		}
+	}
+}
+
+/*
+ * The time stamps of ts.  The prefix is kept formatted: localtime_r() and
+ * strftime() run once a minute, and otherwise only the digits of the
+ * seconds and milliseconds that changed are written.  The clock is read
+ * once per block, as all of it arrived with the same read().  That is the
+ * coarse clock, the one updated at each tick, which costs next to nothing
+ * and is as good as the timing of the reads when the tick is short.
+ */
+#define TSCOARSEMAX	10000000	/* ns: the coarsest tick to use */
+
+#if defined(CLOCK_REALTIME_COARSE)
+#define TSCLOCK	CLOCK_REALTIME_COARSE
+#elif defined(CLOCK_REALTIME_FAST)
+#define TSCLOCK	CLOCK_REALTIME_FAST
+#endif
+
+static struct {
+	clockid_t clock;
+	time_t minute;		/* start of the minute in prefix */
+	time_t sec;
+	long ms;
+	char prefix[TSLEN + 1];
+} tscache;
+
+static void
+tsinit(void)
+{
+	struct timespec ts;
+
+	tscache.clock = CLOCK_REALTIME;
+#if defined(TSCLOCK)
+	if (clock_getres(TSCLOCK, &ts) == 0 && ts.tv_sec == 0 &&
+			ts.tv_nsec <= TSCOARSEMAX)
+		tscache.clock = TSCLOCK;
+#endif
+	tscache.minute = tscache.sec = -60;
+	tscache.ms = -1;
+}
+
+/* bring tscache.prefix to the time ts */
+static void
+tsformat(const struct timespec *ts)
+{
+	struct tm tm;
+	long s;
+
+	if (ts->tv_sec != tscache.sec) {
+		s = ts->tv_sec - tscache.minute;
+		if (s < 0 || s >= 60) {
+			localtime_r(&ts->tv_sec, &tm);
+			strftime(tscache.prefix, sizeof(tscache.prefix),
+					"%Y-%m-%d %H:%M:%S.", &tm);
+			tscache.prefix[TSLEN - 1] = ' ';
+			tscache.ms = -1;
+			s = tm.tm_sec;
+			tscache.minute = ts->tv_sec - s;
+		}
+		tscache.prefix[17] = '0' + s / 10;
+		tscache.prefix[18] = '0' + s % 10;
+		tscache.sec = ts->tv_sec;
+	}
+	if (ts->tv_nsec / 1000000 != tscache.ms) {
+		tscache.ms = ts->tv_nsec / 1000000;
+		tscache.prefix[20] = '0' + tscache.ms / 100;
+		tscache.prefix[21] = '0' + tscache.ms / 10 % 10;
+		tscache.prefix[22] = '0' + tscache.ms % 10;
+	}
+}
+
+/* ts: the local time before each line, as its first byte goes through */
+static void
+xfts(struct xstage *x, const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len, *q;
+	struct timespec ts;
+	unsigned char *b;
+	int fresh = 0;
+
+	while (p < end) {
+		if (x->state == 0) {
+			if (!fresh++) {
+				clock_gettime(tscache.clock, &ts);
+				tsformat(&ts);
+			}
+			b = xfbuf(x, TSLEN);
+			x->used += TSLEN;
+			memcpy(b, tscache.prefix, TSLEN);
+			xfemit(x, b, TSLEN);
+			x->state = 1;
+		}
+		if ((q = memchr(p, '\n', end - p)) == NULL) {
+			xfemit(x, p, end - p);
+			break;
+		}
+		xfemit(x, p, q + 1 - p);
+		x->state = 0;
+		p = q + 1;
+	}
+}
+
+/* hex: the hexdump view, see hexline() */
+static void
+xfhex(struct xstage *x, const unsigned char *p, size_t len)
+{
+	unsigned char *b;
+	size_t n, l;
+
+	for (; len > 0; p += n, len -= n) {
+		n = len < 16 ? len : 16;
+		b = xfbuf(x, HEXLINEMAX);
+		l = hexline((char *)b, '<', x->count, p, n);
+		x->used += l;
+		xfemit(x, b, l);
+		x->count += n;
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(struct xstage *, const unsigned char *, size_t);
+	unsigned char from;
+	const char *to;
+	int grow;
+} xfstages[] = {
+	{ "crlf",	xfmap,	'\r',	"\n",	1 },
+	{ "crcrlf",	xfmap,	'\r',	"\r\n",	2 },
+	{ "igncr",	xfmap,	'\r',	"",	1 },
+	{ "lfcr",	xfmap,	'\n',	"\r",	1 },
+	{ "lfcrlf",	xfmap,	'\n',	"\r\n",	2 },
+	{ "ignlf",	xfmap,	'\n',	"",	1 },
+	{ "ansi",	xfansi,	0,	NULL,	1 },
+	{ "7bit",	xf7bit,	0,	NULL,	1 },
+	{ "ts",		xfts,	0,	NULL,	TSLEN + 1 },
+	{ "hex",	xfhex,	0,	NULL,	HEXLINEMAX },
+	{ NULL }
+};
+
+/*
+ * Append stage i of xfstages to c.
+ */
+static void
+xfadd(struct xchain *c, int i)
+{
+	struct xstage *x = &c->stage[c->n++];
+
+	memset(x, 0, sizeof(*x));
+	x->fn = xfstages[i].fn;
+	x->chain = c;
+	x->from = xfstages[i].from;
+	x->to = xfstages[i].to;
+	x->tolen = x->to != NULL ? strlen(x->to) : 0;
+	x->grow = xfstages[i].grow;
+	c->grow *= x->grow;
+	if (x->fn == xfts)
+		tsinit();
+	if (x->fn == xfhex) {
+		hexinit();
+		x->count = c == &logmap ? 0 : st.rxbytes;
+		if (c == &imap) {
+			hexview.on = 1;
+			hexview.txoff = st.txbytes;
+			hexview.txlen = 0;
+		}
+	}
+}
+
+/*
+ * Set up c from a comma separated list of stages, applied in that order.
+ */
+static int
+xfparse(struct xchain *c, const char *spec)
+{
+	char *s, *p, *name;
+	int i, j;
+
+	if ((s = strdup(spec)) == NULL)
+		err(EX_OSERR, "strdup()");
+	c->n = 0;
+	c->grow = 1;
+	for (p = s; (name = strsep(&p, ",")) != NULL; ) {
+		for (i = 0; xfstages[i].name != NULL; i++) {
+			if (strcmp(name, xfstages[i].name) == 0)
+				break;
+		}
+		if (xfstages[i].name == NULL) {
+			warnx("unknown transform \"%s\"", name);
+			free(s);
+			return -1;
+		}
+		for (j = 0; j < c->n; j++) {
+			if (c->stage[j].fn == xfstages[i].fn &&
+					c->stage[j].from == xfstages[i].from &&
+					c->stage[j].to == xfstages[i].to) {
+				warnx("transform \"%s\" given twice", name);
+				free(s);
+				return -1;
+			}
+		}
+		if (c->n == XFMAX) {
+			warnx("more than %d transforms", XFMAX);
+			free(s);
+			return -1;
+		}
+		xfadd(c, i);
+	}
+	free(s);
+	return 0;
+}
+
+static void
+xfremove(struct xchain *c, int i)
+{
+	memmove(&c->stage[i], &c->stage[i + 1],
+			(c->n - i - 1) * sizeof(c->stage[0]));
+	c->n--;
+	for (c->grow = 1, i = 0; i < c->n; i++)
+		c->grow *= c->stage[i].grow;
+}
+
+/*
+ * ~h: put the hex stage in front of --imap, so it sees the data as it was
+ * received and the other stages work on its lines, or take it out.
+ */
+static void
+hextoggle(void)
+{
+	struct xstage x;
+	int i;
+
+	for (i = 0; i < imap.n; i++) {
+		if (imap.stage[i].fn == xfhex) {
+			xfremove(&imap, i);
+			hexsent();
+			hexview.on = 0;
+			if (!qflag)
+				fprintf(stderr, "->hexdump view off<-\r\n");
+			return;
+		}
+	}
+#if defined(__linux__)
+	if (spfd[0] != -1) {
+		fprintf(stderr, "->splicing output, no hexdump view<-\r\n");
+		return;
+	}
+#endif
+	if (imap.n == XFMAX) {
+		fprintf(stderr, "->no room for the hexdump view in --imap<-\r\n");
+		return;
+	}
+	for (i = 0; xfstages[i].fn != xfhex; i++)
+		;
+	xfadd(&imap, i);
+	x = imap.stage[imap.n - 1];
+	memmove(&imap.stage[1], &imap.stage[0],
+			(imap.n - 1) * sizeof(imap.stage[0]));
+	imap.stage[0] = x;
+	if (!qflag)
+		fprintf(stderr, "->hexdump view on<-\r\n");
+}
+
+/* sinks: the terminal, thr.out, the log and the device */
+static void
+xsinkout(const struct iovec *iov, int n, int fd)
+{
+	if (queue_writev(&outq, fd, iov, n) < 0) {
+		err(EX_OSERR, "could not write to STDOUT.");
+	}
+}
+
+#if !defined(HAS_BROKEN_POLL)
+static void
+xsinkthr(const struct iovec *iov, int n, int fd)
+{
+	spsc_putv(&thr.out, iov, n);
+}
+#endif
+
+static void
+xsinklog(const struct iovec *iov, int n, int fd)
+{
+	spsc_putv(&sesslog.ring, iov, n);
+}
+
+/* with fd -1, only queued, as console_put() does */
+static void
+xsinktx(const struct iovec *iov, int n, int fd)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		tx_tap(iov[i].iov_base, iov[i].iov_len);
+	if (pacing())
+		fd = -1;
+	if (queue_writev(&serq, fd, iov, n) < 0) {
+		err(EX_OSERR, "could not write to serial device.");
+	}
+}
+
+/* serq room needed to take len bytes typed */
+#define txroom(len)	(2 * (size_t)omap.grow * (len))
+
+/*
+ * With the hexdump view on, and unless old output may be dropped, the data
+ * received leaves room on the way to the terminal for the lines of a block
+ * read from the terminal.
+ */
+static size_t
+hexreserve(void)
+{
+	size_t need, size;
+
+	if (!hexview.on || qpolicy == QPOLICY_DROP)
+		return 0;
+	need = ((size_t)omap.grow * RELAYBUFSIZE / 16 + 2) * HEXLINEMAX;
+	size = thr.out.buf != NULL ? thr.out.size : outq.size;
+	/* a queue this small would never let us read */
+	return need < size / 2 ? need : size / 2;
+}
+
+/*
+ * Whether to read a block of len (up to RELAYBUFSIZE) bytes from the
+ * terminal: serq has to have txroom(len), and the terminal the reserve for
+ * the hexdump lines.
+ */
+static int
+consoleroom(size_t len)
+{
+	size_t need = hexreserve();
+
+	if (queue_space(&serq) < txroom(len))
+		return 0;
+	if (need == 0 || hexspace() >= need)
+		return 1;
+	/* have the writer thread wake us once it made room, then recheck */
+	if (thr.out.buf != NULL) {
+		atomic_store(&thr.stalled, 1);
+		if (hexspace() >= need) {
+			atomic_store(&thr.stalled, 0);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct console {
+	int sfd;
+	int escchr;
+	enum escapestates escapestate;
+	unsigned char escapedigit;
+	char search[256];
+	size_t searchlen;
+	int searchre;
+};
+
+/*
+ * Write out everything queued for the serial device, for actions that
+ * must be ordered with the data stream.
+ */
+static int
+console_flush(struct console *con)
+{
+	int r;
+
+	if ((r = txdrain(con->sfd, -1)) < 0) {
+		err(EX_OSERR, "could not write to serial device.");
+	}
+	return r;
+}
+
+static void
+console_put(struct console *con, unsigned char c)
+{
+	if (omap.n > 0) {
+		xfrun(&omap, &c, 1, xsinktx, -1);
+		return;
+	}
+	tx_tap(&c, 1);
+	queue_put(&serq, &c, 1);
+}
+
+/*
+ * Forward a span of passthrough bytes, straight from the input buffer if
+ * the serial device takes them.
+ */
+static void
+console_write(struct console *con, const unsigned char *p, size_t len)
+{
+	if (omap.n > 0)
+		xfrun(&omap, p, len, xsinktx, con->sfd);
+	else
+		txwrite(con->sfd, p, len);
+}
+
+#if defined(INPUTBENCH)
+static int perbyte;		/* run every byte through the switch */
+#endif
+
+/*
+ * Find the next byte the escape state machine has to look at while it is
+ * waiting for a carriage return, the '\r' itself.  memchr() is vectorized
+ * by every libc we care about.
+ */
+static const unsigned char *
+scanspecial(const unsigned char *buf, const unsigned char *end)
+{
+	const unsigned char *p;
+
+#if defined(INPUTBENCH)
+	if (perbyte)
+		return buf;
+#endif
+	p = memchr(buf, '\r', end - buf);
+	return p != NULL ? p : end;
+}
+
+/*
+ * Render coalescing (--render): output goes to the terminal in one write
+ * per frame, RENDERHZ times a second, and at most rate bytes a second, so
+ * a terminal emulator drowning in output cannot hold up the escapes.  Once
+ * about a second's worth is waiting, the backlog is skipped up to the last
+ * frame, resuming at the start of a line, and a marker says how much was
+ * left out.  The scrollback, log and capture still see everything.
+ */
+#define RENDERHZ	50
+
+static struct {
+	size_t rate;		/* bytes per second, 0 for off */
+	size_t frame;		/* bytes per frame */
+	size_t backlog;		/* skip once more than this is queued */
+	uint64_t next;		/* time of the next frame */
+	unsigned long long skipped;
+} render;
+
+static void
+renderinit(void)
+{
+	render.frame = render.rate / RENDERHZ > 0 ? render.rate / RENDERHZ : 1;
+	/* room for the marker in front of the last frame */
+	render.backlog = render.rate > render.frame + 256 ?
+		render.rate : render.frame + 256;
+	if (render.backlog > outq.size / 2)
+		render.backlog = outq.size / 2;
+	render.next = 0;
+}
+
+static void
+renderskip(void)
+{
+	char marker[80];
+	size_t skip;
+	ssize_t nl;
+	int i, n;
+
+	if (queue_len(&outq) <= render.backlog)
+		return;
+	skip = queue_len(&outq) - render.frame;
+	outq.head += skip;
+	nl = queue_find(&outq, '\n', queue_len(&outq));
+	if (nl >= 0 && (size_t)nl + 1 < queue_len(&outq)) {
+		outq.head += nl + 1;
+		skip += nl + 1;
+	}
+	render.skipped += skip;
+	/* the marker goes where the skipped data was */
+	n = snprintf(marker, sizeof(marker), "\r\n->%zu bytes skipped%s<-\r\n",
+			skip, sesslog.fd != -1 || caplog.fd != -1 ? ", see log" : "");
+	if ((size_t)n > skip)
+		return;
+	outq.head -= n;
+	for (i = 0; i < n; i++)
+		outq.buf[(outq.head + i) & (outq.size - 1)] = marker[i];
+}
+
+/*
+ * Milliseconds until the next frame is due, or -1 if there is nothing to
+ * show.
+ */
+static int
+renderwait(void)
+{
+	uint64_t now;
+
+	if (render.rate == 0 || queue_len(&outq) == 0)
+		return -1;
+	now = nsnow();
+	return now >= render.next ? 0 : (render.next - now + 999999) / 1000000;
+}
+
+/*
+ * Forwarding latency: terminal input read at time t has been written to
+ * the serial device once serq.head passes pos.  Samples are skipped while
+ * too many blocks are in flight.
+ */
+#define TXMARKS	64
+
+static struct {
+	size_t pos;
+	uint64_t t;
+} txmarks[TXMARKS];
+static unsigned txmarkhead, txmarktail;
+
+static void
+txmark(uint64_t t)
+{
+	if (queue_len(&serq) == 0) {
+		hist_add(&st.txlatency, nsnow() - t);
+	} else if (txmarktail - txmarkhead < TXMARKS) {
+		txmarks[txmarktail % TXMARKS].pos = serq.tail;
+		txmarks[txmarktail % TXMARKS].t = t;
+		txmarktail++;
+	}
+}
+
+static void
+txmarkdone(void)
+{
+	uint64_t now = 0;
+
+	while (txmarkhead != txmarktail &&
+			txmarks[txmarkhead % TXMARKS].pos <= serq.head) {
+		if (now == 0)
+			now = nsnow();
+		hist_add(&st.txlatency, now - txmarks[txmarkhead % TXMARKS].t);
+		txmarkhead++;
+	}
+}
+
+static void
+printstats(void)
+{
+	const struct hist *h = &st.txlatency;
+
+	fprintf(stderr, "->statistics<-\r\n"
+			"serial -> terminal: %llu bytes in %llu chunks\r\n"
+			"terminal -> serial: %llu bytes in %llu chunks, %llu breaks\r\n"
+			"%llu wakeups, %llu short writes, RTS deasserted %lu times\r\n"
+			"dropped: %llu bytes output, %llu bytes log, %llu bytes capture\r\n",
+			st.rxbytes, st.rxchunks, st.txbytes, st.txchunks, st.breaks,
+			st.wakeups, st.shortwrites + atomic_load(&thr.shortwrites),
+			atomic_load(&rtsthrottled), outq.dropped +
+			atomic_load(&thr.rx.dropped) + atomic_load(&thr.out.dropped),
+			atomic_load(&sesslog.ring.dropped),
+			atomic_load(&caplog.ring.dropped));
+	if (ac.nrules > 0) {
+		unsigned long long hits = 0;
+		int i;
+
+		for (i = 0; i < ac.nrules; i++)
+			hits += ac.rules[i].hits;
+		fprintf(stderr, "%d expect rules, %llu answered, %d pending\r\n",
+				ac.nrules, hits, ac.npending);
+	}
+	if (render.rate > 0)
+		fprintf(stderr, "%llu bytes skipped on the terminal\r\n", render.skipped);
+	if (h->n > 0)
+		fprintf(stderr, "forwarding latency%s: p50 %.1f us, p90 %.1f us, "
+				"p99 %.1f us, p99.9 %.1f us, max %.1f us (%llu samples)\r\n",
+				lowlat >= 0 ? " (low latency)" : "", hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3,
+				hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3,
+				h->max / 1e3, h->n);
+}
+
+/*
+ * Run a block of bytes read from the terminal through the escape state
+ * machine.  Bytes destined for the serial device are collected in serq
+ * and written with as few calls as possible, as far as pacing allows; the
+ * queue is drained before any action that must be ordered with the data
+ * stream (break).  Runs of bytes that cannot change the state are forwarded as a
+ * single span.  The caller guarantees room for txroom(len) bytes in serq.
+ */
+static void
+console_input(struct console *con, const unsigned char *buf, size_t len)
+{
+	const unsigned char *end = buf + len;
+	const unsigned char *p;
+	uint64_t t = nsnow();
+	unsigned char c;
+
+	st.txchunks++;
+	for (; buf < end && scrunning; buf++) {
+		if (con->escapestate == ESCAPESTATE_WAITFORCR) {
+			p = scanspecial(buf, end);
+			if (p > buf) {
+				console_write(con, buf, p - buf);
+				buf = p;
+				if (buf == end)
+					break;
+			}
+		}
+		c = *buf;
+		switch (con->escapestate) {
+			case ESCAPESTATE_WAITFORCR:
+				if (c == '\r') {
+					con->escapestate = ESCAPESTATE_WAITFOREC;
+				}
+				break;
+
+			case ESCAPESTATE_WAITFOREC:
+				if (con->escchr != -1 && c == con->escchr) {
+					con->escapestate = ESCAPESTATE_PROCESSCMD;
+					continue;
+				}
+				if (c != '\r') {
+					con->escapestate = ESCAPESTATE_WAITFORCR;
+				}
+				break;
+
+			case ESCAPESTATE_PROCESSCMD:
+				con->escapestate = ESCAPESTATE_WAITFORCR;
+				switch (c) {
+					case '.':
+						scrunning = 0;
+						continue;
+
+					case 'b':
+					case 'B':
+						if (console_flush(con) != 0)
+							continue;
+						if(!qflag)
+							fprintf(stderr, "->sending a break<-\r\n");
+						txbreak(con->sfd);
+						continue;
+
+					case 'k':
+					case 'K':
+						fprintf(stderr, "->stop sending key sequence<-\r\n");
+						keystop();
+						continue;
+
+					case 's':
+					case 'S':
+						printstats();
+						continue;
+
+					case 'h':
+					case 'H':
+						hextoggle();
+						continue;
+
+					case 'x':
+					case 'X':
+						con->escapestate = ESCAPESTATE_WAITFOR1STHEXDIGIT;
+						continue;
+
+					case '/':
+					case 'r':
+					case 'R':
+						con->searchre = c != '/';
+						con->searchlen = 0;
+						con->escapestate = ESCAPESTATE_SEARCH;
+						fprintf(stderr, "->search%s: ", con->searchre ? " regex" : "");
+						continue;
+
+					default:
+						if (c != con->escchr) {
+							console_put(con, con->escchr);
+						}
+				}
+				break;
+
+			case ESCAPESTATE_WAITFOR1STHEXDIGIT:
+				if (isxdigit(c)) {
+					con->escapedigit = hex2dec(c) * 16;
+					con->escapestate = ESCAPESTATE_WAITFOR2NDHEXDIGIT;
+				} else {
+					con->escapestate = ESCAPESTATE_WAITFORCR;
+					if(!qflag)
+						fprintf(stderr, "->invalid hex digit '%c'<-\r\n", c);
+				}
+				continue;
+
+			case ESCAPESTATE_WAITFOR2NDHEXDIGIT:
+				con->escapestate = ESCAPESTATE_WAITFORCR;
+				if(isxdigit(c)) {
+					con->escapedigit += hex2dec(c);
+					console_put(con, con->escapedigit);
+					if(!qflag)
+						fprintf(stderr, "->wrote 0x%02X character '%c'<-\r\n", con->escapedigit, isprint(con->escapedigit)?con->escapedigit:'.');
+				} else {
+					if(!qflag)
+						fprintf(stderr, "->invalid hex digit '%c'<-\r\n", c);
+				}
+				continue;
+
+			case ESCAPESTATE_SEARCH:
+				if (c == '\r' || c == '\n') {
+					con->escapestate = ESCAPESTATE_WAITFOREC;
+					fputs("\r\n", stderr);
+					con->search[con->searchlen] = '\0';
+					if (con->searchlen > 0)
+						historysearch(con->search, con->searchre);
+				} else if (c == 0x1b || c == 0x03) {
+					con->escapestate = ESCAPESTATE_WAITFOREC;
+					fputs("\r\n", stderr);
+				} else if (c == 0x7f || c == '\b') {
+					if (con->searchlen > 0) {
+						con->searchlen--;
+						fputs("\b \b", stderr);
+					}
+				} else if (c >= ' ' && con->searchlen < sizeof(con->search) - 1) {
+					con->search[con->searchlen++] = c;
+					fputc(c, stderr);
+				}
+				continue;
+		}
+		console_put(con, c);
+	}
+	hexsent();
+	if (txflush(con->sfd) < 0) {
+		err(EX_OSERR, "could not write to serial device.");
+	}
+	txmark(t);
+}
+
+/*
+ * Everything received from the serial device passes here on its way out:
+ * the scrollback, the expect rules, the log and the capture.
+ */
+static void
+rx_tap(int sfd, const unsigned char *buf, size_t len)
+{
+	st.rxbytes += len;
+	if (history.maxchunks > 0)
+		historyadd(buf, len);
+	if (ac.nrules > 0 && expectscan(buf, len) > 0 && txflush(sfd) < 0) {
+		err(EX_OSERR, "could not write to serial device.");
+	}
+	if (sesslog.fd != -1 && logmap.n > 0)
+		xfrun(&logmap, buf, len, xsinklog, -1);
+	else if (sesslog.fd != -1)
+		spsc_put(&sesslog.ring, buf, len);
+	capture(SCCAP_RX, buf, len);
+}
+
+/*
+ * Hand a block of data received from the serial device to the log and
+ * stdout.
+ */
+static void
+rx_data(int sfd, const unsigned char *buf, size_t len)
+{
+	st.rxchunks++;
+	rx_tap(sfd, buf, len);
+	if (imap.n > 0) {
+		xfrun(&imap, buf, len, xsinkout,
+				render.rate > 0 ? -1 : STDOUT_FILENO);
+		if (render.rate > 0)
+			renderskip();
+	} else if (render.rate > 0) {
+		queue_put(&outq, buf, len);
+		renderskip();
+	} else if (queue_write(&outq, STDOUT_FILENO, buf, len) < 0) {
+		err(EX_OSERR, "could not write to STDOUT.");
+	}
+	rtsupdate(sfd, queue_len(&outq), outq.size, &rtsoff);
+}
+
+/*
+ * How much to read from the serial device right now: as much as outq (or
+ * the splice pipe) can take, or a full block if old data may be dropped.
+ */
+static size_t
+rxroom(void)
+{
+#if defined(__linux__)
+	if (spfd[0] != -1)
+		return splicelen < SPLICEMAX || qpolicy == QPOLICY_DROP ? SPLICEMAX : 0;
+#endif
+	size_t space = queue_space(&outq), reserve = hexreserve();
+
+	if (qpolicy == QPOLICY_DROP || space > RELAYBUFSIZE * imap.grow + reserve)
+		return RELAYBUFSIZE;
+	return space > reserve ? (space - reserve) / imap.grow : 0;
+}
+
+static int
+outpending(void)
+{
+#if defined(__linux__)
+	if (splicelen > 0)
+		return 1;
+#endif
+	if (render.rate > 0)
+		return renderwait() == 0;
+	return queue_len(&outq) > 0;
+}
+
+static void
+outflush(int sfd)
+{
+	if (render.rate > 0) {
+		renderskip();
+		if (queue_flushn(&outq, STDOUT_FILENO, render.frame) < 0) {
+			err(EX_OSERR, "could not write to STDOUT.");
+		}
+		render.next = nsnow() + 1000000000 / RENDERHZ;
+	} else if (queue_flush(&outq, STDOUT_FILENO) < 0) {
+		err(EX_OSERR, "could not write to STDOUT.");
+	}
+#if defined(__linux__)
+	if (spfd[0] != -1) {
+		spliceout();
+		rtsupdate(sfd, splicelen, SPLICEMAX, &rtsoff);
+		return;
+	}
+#endif
+	rtsupdate(sfd, queue_len(&outq), outq.size, &rtsoff);
+}
+
+/*
+ * Control socket (--control): a UNIX domain socket taking commands, one
+ * per line, and answering each with a line starting with "ok" or "error".
+ * One connection is served at a time; the relay loops poll the connection,
+ * or the listening socket while there is none, along with everything else.
+ */
+#define CTLLINEMAX	4096
+
+static struct {
+	char *path;
+	int lfd;
+	int fd;			/* the connection, or -1 */
+	char buf[CTLLINEMAX];
+	size_t len;
+} ctl = { NULL, -1, -1 };
+
+static int
+ctlfd(void)
+{
+	return ctl.fd != -1 ? ctl.fd : ctl.lfd;
+}
+
+static void
+ctldrop(void)
+{
+	close(ctl.fd);
+	ctl.fd = -1;
+	ctl.len = 0;
+}
+
+static void
+ctlreply(const char *fmt, ...)
+{
+	char line[512];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n > (int)sizeof(line) - 2)
+		n = sizeof(line) - 2;
+	line[n++] = '\n';
+	/* a client that does not read its replies is dropped */
+	if (write(ctl.fd, line, n) != n)
+		ctldrop();
+}
+
+/*
+ * Send what is queued, held back by pacing included, before a break or a
+ * change of the line settings, so a script's commands keep their order.
+ */
+static int
+ctldrain(int sfd)
+{
+	int r;
+
+	if ((r = txdrain(sfd, -1)) < 0) {
+		err(EX_OSERR, "could not write to serial device.");
+	}
+	if (r > 0)
+		ctlreply("error interrupted");
+	return r;
+}
+
+static void
+ctlspeed(int sfd, char *arg)
+{
+	struct termios ti;
+	long other, rate;
+	char *ep;
+
+	rate = strtol(arg, &ep, 0);
+	if (ep == arg || *ep != '\0' || rate <= 0) {
+		ctlreply("error invalid speed \"%s\"", arg);
+		return;
+	}
+	if (ctldrain(sfd) != 0)
+		return;
+	if (tcgetattr(sfd, &ti) || cfsetspeed(&ti, parsespeed(arg, &other)) ||
+			tcsetattr(sfd, TCSADRAIN, &ti) ||
+			(other > 0 && scbaud_set(sfd, other) < 0)) {
+		ctlreply("error speed %s: %s", arg, strerror(errno));
+		return;
+	}
+	if ((other = scbaud_get(sfd)) > 0)
+		rate = other;
+	ctlreply("ok %ld", rate);
+}
+
+static void
+ctlparms(int sfd, char *arg)
+{
+	struct termios ti;
+
+	if (tcgetattr(sfd, &ti)) {
+		ctlreply("error %s", strerror(errno));
+		return;
+	}
+	if (parseparms(&ti.c_cflag, arg, ti.c_cflag & CRTSCTS,
+				!(ti.c_cflag & CLOCAL))) {
+		ctlreply("error invalid parameters \"%s\"", arg);
+		return;
+	}
+	if (ctldrain(sfd) != 0)
+		return;
+	if (tcsetattr(sfd, TCSADRAIN, &ti)) {
+		ctlreply("error %s", strerror(errno));
+		return;
+	}
+	ctlreply("ok");
+}
+
+/*
+ * send: hex digits, two per byte, spaces allowed, queued like typed input.
+ */
+static void
+ctlsend(int sfd, char *arg)
+{
+	unsigned char buf[CTLLINEMAX / 2];
+	size_t len = 0;
+	int digits = 0;
+
+	for (; *arg != '\0'; arg++) {
+		if (isspace((unsigned char)*arg))
+			continue;
+		if (!isxdigit((unsigned char)*arg)) {
+			ctlreply("error invalid hex digit '%c'", *arg);
+			return;
+		}
+		if (digits++ % 2 == 0)
+			buf[len] = hex2dec(*arg) << 4;
+		else
+			buf[len++] |= hex2dec(*arg);
+	}
+	if (len == 0 || digits % 2 != 0) {
+		ctlreply("error send needs whole bytes in hex");
+		return;
+	}
+	if (queue_space(&serq) < len) {
+		ctlreply("error busy");
+		return;
+	}
+	st.txchunks++;
+	txwrite(sfd, buf, len);
+	hexsent();
+	ctlreply("ok %zu", len);
+}
+
+static void
+ctlcommand(int sfd, char *line)
+{
+	char *arg;
+
+	arg = line + strcspn(line, " \t");
+	if (*arg != '\0')
+		*arg++ = '\0';
+	arg += strspn(arg, " \t");
+	if (strcmp(line, "break") == 0) {
+		if (ctldrain(sfd) == 0) {
+			txbreak(sfd);
+			ctlreply("ok");
+		}
+	} else if (strcmp(line, "send") == 0) {
+		ctlsend(sfd, arg);
+	} else if (strcmp(line, "speed") == 0) {
+		ctlspeed(sfd, arg);
+	} else if (strcmp(line, "parms") == 0) {
+		ctlparms(sfd, arg);
+	} else if (strcmp(line, "dtr") == 0 &&
+			(strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0)) {
+		modemcontrol(sfd, arg[1] == 'n');
+		ctlreply("ok");
+	} else if (strcmp(line, "stats") == 0) {
+		ctlreply("ok rxbytes %llu rxchunks %llu txbytes %llu txchunks %llu "
+				"breaks %llu wakeups %llu shortwrites %llu dropped %llu",
+				st.rxbytes, st.rxchunks, st.txbytes, st.txchunks,
+				st.breaks, st.wakeups,
+				st.shortwrites + atomic_load(&thr.shortwrites), outq.dropped +
+				atomic_load(&thr.rx.dropped) + atomic_load(&thr.out.dropped));
+	} else if (*line != '\0') {
+		ctlreply("error unknown command \"%s\"", line);
+	}
+}
+
+/*
+ * The socket ctlfd() returned is readable: take a connection, or run the
+ * complete lines that arrived.
+ */
+static void
+ctlevent(int sfd)
+{
+	char *p, *nl;
+	ssize_t n;
+	int i;
+
+	if (ctl.fd == -1) {
+		if ((ctl.fd = accept(ctl.lfd, NULL, NULL)) < 0) {
+			ctl.fd = -1;
+			return;
+		}
+		i = fcntl(ctl.fd, F_GETFL);
+		if (i != -1)
+			fcntl(ctl.fd, F_SETFL, i | O_NONBLOCK);
+		return;
+	}
+	n = read(ctl.fd, ctl.buf + ctl.len, sizeof(ctl.buf) - ctl.len);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n <= 0) {
+		ctldrop();
+		return;
+	}
+	ctl.len += n;
+	for (p = ctl.buf; ctl.fd != -1 &&
+			(nl = memchr(p, '\n', ctl.len - (p - ctl.buf))) != NULL;
+			p = nl + 1) {
+		*nl = '\0';
+		if (nl > p && nl[-1] == '\r')
+			nl[-1] = '\0';
+		ctlcommand(sfd, p);
+	}
+	if (ctl.fd == -1)
+		return;
+	ctl.len -= p - ctl.buf;
+	memmove(ctl.buf, p, ctl.len);
+	if (ctl.len == sizeof(ctl.buf)) {
+		ctlreply("error line too long");
+		ctldrop();
+	}
+}
+
+/*
+ * Detached sessions (--daemon, sc attach): the daemon keeps the output of
+ * the device in a ring in a shared file mapping, <session>.ring, next to
+ * its socket <session>.sock.  An attached sc maps the ring, prints the
+ * scrollback straight from it and then follows new output there; the
+ * daemon only sends it a byte over the socket as a wakeup, which is
+ * skipped if the client is not keeping up.  The client's keystrokes go
+ * over the socket.
+ */
+#define RINGMAGIC	"SCRING1\n"
+#define RINGDATA	4096	/* offset of the data in the file */
+
+struct ringhdr {
+	char magic[8];
+	uint64_t size;
+	_Atomic uint64_t tail;	/* bytes written so far */
+};
+
+static struct ringhdr *shm;
+static uint64_t shmpos;		/* attached: next position to show */
+
+#define shmdata()	((unsigned char *)shm + RINGDATA)
+
+/*
+ * Attached: show what is new in the ring.  The daemon may overwrite data
+ * while it is being written out, which is detected afterwards.
+ */
+static void
+ringfollow(int sfd)
+{
+	unsigned char buf[256];
+	/* the daemon reads up to RELAYBUFSIZE past tail into the ring */
+	uint64_t keep = shm->size - RELAYBUFSIZE;
+	uint64_t start, tail, lost = 0;
+	size_t off, n;
+	ssize_t len;
+
+	while ((len = read(sfd, buf, sizeof(buf))) == sizeof(buf))
+		;
+	if (len == 0) {
+		fprintf(stderr, "\r\n->session closed<-\r\n");
+		scrunning = 0;
+	}
+	tail = atomic_load_explicit(&shm->tail, memory_order_acquire);
+	if (tail - shmpos > keep) {
+		lost = tail - shmpos - keep;
+		shmpos = tail - keep;
+	}
+	start = shmpos;
+	while (shmpos != tail) {
+		off = shmpos & (shm->size - 1);
+		n = shm->size - off < tail - shmpos ? shm->size - off : tail - shmpos;
+		rx_data(sfd, shmdata() + off, n);
+		shmpos += n;
+	}
+	/* what was overwritten while it was being copied is garbage */
+	tail = atomic_load_explicit(&shm->tail, memory_order_acquire);
+	if (tail - start > keep)
+		lost += tail - start - keep < shmpos - start ? tail - start - keep : shmpos - start;
+	if (lost > 0)
+		fprintf(stderr, "\r\n->%llu bytes of output lost<-\r\n",
+				(unsigned long long)lost);
+}
+
+#if defined(HAS_IO_URING)
+/*
+ * io_uring backend for loop(), on Linux.  Every trip into the kernel
+ * submits all there is to do, a read from the terminal and one from the
+ * serial device, each linked behind a poll for its readiness, and a write
+ * of queued output to stdout, and waits for the first completion or the
+ * next deadline.  poll() takes a system call for that and one more for
+ * every read and write.  The buffers are registered with the ring where
+ * the kernel allows it.  Output is copied from outq into a buffer of its
+ * own for the write, so outq may change while the write is in flight.
+ * Writes to the serial device are left to txflush(), with a poll for
+ * POLLOUT when the device is full, since pacing needs them one at a time.
+ */
+#define URING_STDIN	0
+#define URING_SERIAL	1
+#define URING_STDOUT	2
+#define URING_SEROUT	3
+#define URING_POLL	4	/* the polls the reads are linked to */
+#define URING_CTL	5	/* the control socket */
+
+static struct {
+	int fd;
+	unsigned char *ring;
+	size_t ringsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	unsigned *sqhead, *sqtail, *sqarray, sqmask;
+	unsigned *cqhead, *cqtail, cqmask;
+	struct io_uring_cqe *cqes;
+	unsigned sqnext;	/* tail including the sqes not submitted */
+	unsigned busy;		/* 1 << URING_* for requests in flight */
+	int fixed;		/* buffers are registered */
+	int outblocked;		/* stdout is full, poll before writing */
+	size_t outoff, outlen;	/* left to write from buf[URING_STDOUT] */
+	unsigned char buf[3][RELAYBUFSIZE];
+} uring = { -1 };
+
+static void
+uringclose(void)
+{
+	munmap(uring.sqes, uring.sqessize);
+	munmap(uring.ring, uring.ringsize);
+	close(uring.fd);
+	uring.fd = -1;
+}
+
+static int
+uringopen(void)
+{
+	struct io_uring_params p;
+	struct iovec iov[3];
+	size_t sqsize, cqsize;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	uring.fd = syscall(__NR_io_uring_setup, 16, &p);
+	if (uring.fd < 0 && errno == EINVAL) {
+		/* before Linux 6.1 */
+		memset(&p, 0, sizeof(p));
+		uring.fd = syscall(__NR_io_uring_setup, 16, &p);
+	}
+	if (uring.fd < 0)
+		return -1;
+	/* waiting with a timeout needs Linux 5.11 */
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		close(uring.fd);
+		uring.fd = -1;
+		errno = ENOSYS;
+		return -1;
+	}
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	uring.ringsize = sqsize > cqsize ? sqsize : cqsize;
+	uring.sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring.ring = mmap(NULL, uring.ringsize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	uring.sqes = mmap(NULL, uring.sqessize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+		i = errno;
+		if (uring.ring != MAP_FAILED)
+			munmap(uring.ring, uring.ringsize);
+		if (uring.sqes != MAP_FAILED)
+			munmap(uring.sqes, uring.sqessize);
+		close(uring.fd);
+		uring.fd = -1;
+		errno = i;
+		return -1;
+	}
+	uring.sqhead = (unsigned *)(uring.ring + p.sq_off.head);
+	uring.sqtail = (unsigned *)(uring.ring + p.sq_off.tail);
+	uring.sqarray = (unsigned *)(uring.ring + p.sq_off.array);
+	uring.sqmask = *(unsigned *)(uring.ring + p.sq_off.ring_mask);
+	uring.cqhead = (unsigned *)(uring.ring + p.cq_off.head);
+	uring.cqtail = (unsigned *)(uring.ring + p.cq_off.tail);
+	uring.cqmask = *(unsigned *)(uring.ring + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(uring.ring + p.cq_off.cqes);
+	uring.sqnext = *uring.sqtail;
+	uring.busy = 0;
+	uring.outblocked = 0;
+	uring.outoff = uring.outlen = 0;
+
+	/* pinned memory counts against RLIMIT_MEMLOCK */
+	for (i = 0; i < 3; i++) {
+		iov[i].iov_base = uring.buf[i];
+		iov[i].iov_len = RELAYBUFSIZE;
+	}
+	uring.fixed = syscall(__NR_io_uring_register, uring.fd,
+			IORING_REGISTER_BUFFERS, iov, 3) == 0;
+	return 0;
+}
+
+static struct io_uring_sqe *
+uringsqe(int op, int fd, unsigned ud)
+{
+	unsigned i = uring.sqnext++ & uring.sqmask;
+	struct io_uring_sqe *sqe = &uring.sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = ud;
+	uring.sqarray[i] = i;
+	if (ud != URING_POLL)
+		uring.busy |= 1 << ud;
+	return sqe;
+}
+
+/* poll fd for events, and run the next request when it is ready */
+static void
+uringpoll(int fd, unsigned ud, short events, int link)
+{
+	struct io_uring_sqe *sqe = uringsqe(IORING_OP_POLL_ADD, fd, ud);
+
+	/* the 16 bit field is the same on either byte order */
+	sqe->poll_events = events;
+	if (link)
+		sqe->flags |= IOSQE_IO_LINK;
+}
+
+static void
+uringrw(int op, int fd, unsigned ud, unsigned char *p, size_t len)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uring.fixed)
+		op = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+	sqe = uringsqe(op, fd, ud);
+	sqe->off = (uint64_t)-1;
+	sqe->addr = (uintptr_t)p;
+	sqe->len = len;
+	sqe->buf_index = ud;
+}
+
+static void
+uringwrite(void)
+{
+	struct iovec iov[2];
+
+	if (uring.outlen == 0) {
+		uring.outoff = 0;
+		uring.outlen = queue_len(&outq) < RELAYBUFSIZE ?
+				queue_len(&outq) : RELAYBUFSIZE;
+		if (queue_iov(&outq, outq.head, uring.outlen, iov) > 1)
+			memcpy(uring.buf[URING_STDOUT] + iov[0].iov_len,
+					iov[1].iov_base, iov[1].iov_len);
+		memcpy(uring.buf[URING_STDOUT], iov[0].iov_base, iov[0].iov_len);
+		outq.head += uring.outlen;
+	}
+	if (uring.outblocked)
+		uringpoll(STDOUT_FILENO, URING_POLL, POLLOUT, 1);
+	uringrw(IORING_OP_WRITE, STDOUT_FILENO, URING_STDOUT,
+			uring.buf[URING_STDOUT] + uring.outoff, uring.outlen);
+}
+
+/*
+ * Submit the queued requests and wait up to ms milliseconds, or without
+ * a limit if ms is negative, for at least one to complete.
+ */
+static int
+uringenter(int ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+
+	atomic_store_explicit((_Atomic unsigned *)uring.sqtail, uring.sqnext,
+			memory_order_release);
+	memset(&arg, 0, sizeof(arg));
+	if (ms >= 0) {
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000L;
+		arg.ts = (uintptr_t)&ts;
+	}
+	return syscall(__NR_io_uring_enter, uring.fd,
+			uring.sqnext - *(volatile unsigned *)uring.sqhead, 1,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg));
+}
+
+/*
+ * Handle the completed requests.  Returns 0, or an exit code if the loop
+ * has to end.
+ */
+static int
+uringreap(int sfd, struct console *con)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head = *uring.cqhead, tail, ud;
+	int res, rv = 0;
+
+	tail = atomic_load_explicit((_Atomic unsigned *)uring.cqtail,
+			memory_order_acquire);
+	for (; head != tail; head++) {
+		cqe = &uring.cqes[head & uring.cqmask];
+		ud = cqe->user_data;
+		res = cqe->res;
+		atomic_store_explicit((_Atomic unsigned *)uring.cqhead, head + 1,
+				memory_order_release);
+		if (ud != URING_POLL)
+			uring.busy &= ~(1 << ud);
+		if (res == -EAGAIN || res == -EINTR || res == -ECANCELED) {
+			if (ud == URING_STDOUT) {
+				st.shortwrites++;
+				uring.outblocked = 1;
+			}
+			continue;
+		}
+		switch (ud) {
+			case URING_POLL:
+				/*
+				 * A change to the termios of the device (--control)
+				 * ends the poll on it with EINVAL; it is armed again.
+				 */
+				if (res < 0 && res != -EINVAL) {
+					errno = -res;
+					warn("io_uring poll");
+					rv = EX_OSERR;
+				}
+				break;
+
+			case URING_STDIN:
+				if (res <= 0) {
+					errno = res < 0 ? -res : EIO;
+					warn("read(tty)");
+					rv = EX_OSERR;
+					break;
+				}
+				console_input(con, uring.buf[URING_STDIN], res);
+				break;
+
+			case URING_SERIAL:
+				if (res <= 0) {
+					errno = res < 0 ? -res : EIO;
+					warn("read(serial)");
+					rv = EX_OSERR;
+					break;
+				}
+				st.rxchunks++;
+				rx_tap(sfd, uring.buf[URING_SERIAL], res);
+				if (imap.n > 0)
+					xfrun(&imap, uring.buf[URING_SERIAL], res,
+							xsinkout, -1);
+				else
+					queue_put(&outq, uring.buf[URING_SERIAL], res);
+				rtsupdate(sfd, queue_len(&outq), outq.size, &rtsoff);
+				break;
+
+			case URING_STDOUT:
+				if (res < 0) {
+					errno = -res;
+					err(EX_OSERR, "could not write to STDOUT.");
+				}
+				if ((size_t)res < uring.outlen)
+					st.shortwrites++;
+				uring.outoff += res;
+				uring.outlen -= res;
+				uring.outblocked = 0;
+				rtsupdate(sfd, queue_len(&outq), outq.size, &rtsoff);
+				break;
+
+			case URING_SEROUT:
+				if (txflush(sfd) < 0) {
+					err(EX_OSERR, "could not write to serial device.");
+				}
+				txmarkdone();
+				break;
+
+			case URING_CTL:
+				ctlevent(sfd);
+				break;
+		}
+	}
+	return rv;
+}
+
+static int
+uringloop(int sfd, struct console *con)
+{
+	size_t room;
+	int txms, ms, n, rv = 0;
+
+	while (scrunning && rv == 0) {
+		room = rxroom();
+		txms = txwait();
+		ms = keywait();
+		if (txms > 0 && (ms < 0 || txms < ms))
+			ms = txms;
+		if (!(uring.busy & (1 << URING_STDIN)) &&
+				consoleroom(RELAYBUFSIZE)) {
+			uringpoll(STDIN_FILENO, URING_POLL, POLLIN, 1);
+			uringrw(IORING_OP_READ, STDIN_FILENO, URING_STDIN,
+					uring.buf[URING_STDIN], RELAYBUFSIZE);
+		}
+		if (!(uring.busy & (1 << URING_SERIAL)) && room > 0) {
+			uringpoll(sfd, URING_POLL, POLLIN, 1);
+			uringrw(IORING_OP_READ, sfd, URING_SERIAL,
+					uring.buf[URING_SERIAL], room);
+		}
+		if (!(uring.busy & (1 << URING_SEROUT)) && txms == 0)
+			uringpoll(sfd, URING_SEROUT, POLLOUT, 0);
+		if (!(uring.busy & (1 << URING_CTL)) && ctlfd() != -1)
+			uringpoll(ctlfd(), URING_CTL, POLLIN, 0);
+		if (!(uring.busy & (1 << URING_STDOUT)) &&
+				(uring.outlen > 0 || queue_len(&outq) > 0))
+			uringwrite();
+
+		if ((n = uringenter(ms)) < 0 && errno != EINTR && errno != ETIME) {
+			warn("io_uring_enter()");
+			rv = EX_OSERR;
+			break;
+		}
+		st.wakeups++;
+		if (statsrequested) {
+			statsrequested = 0;
+			printstats();
+		}
+
+		/* key sequences and pacing deadlines */
+		if ((keysend() + expectretry() > 0 || (n < 0 && errno == ETIME)) && txflush(sfd) < 0) {
+			err(EX_OSERR, "could not write to serial device.");
+		}
+		rv = uringreap(sfd, con);
+	}
+
+	/* let a write in flight finish, then write out what is left of it */
+	while ((uring.busy & (1 << URING_STDOUT)) &&
+			(uringenter(100) >= 0 || errno == EINTR))
+		uringreap(sfd, con);
+	if (uring.outlen > 0)
+		write(STDOUT_FILENO, uring.buf[URING_STDOUT] + uring.outoff, uring.outlen);
+	uringclose();
+	return rv;
+}
+#endif
+
+#if !defined(HAS_BROKEN_POLL)
+static void
+threadwake(void)
+{
+	write(thr.wake[1], "", 1);
+}
+
+static void *
+rxthread(void *arg)
+{
+	struct pollfd pfds[2];
+	struct iovec iov[2];
+	unsigned char scratch[RELAYBUFSIZE];
+	size_t room;
+	ssize_t n;
+
+#if defined(__linux__)
+	if (thr.cpu >= 0) {
+		cpu_set_t set;
+		int i;
+
+		CPU_ZERO(&set);
+		CPU_SET(thr.cpu, &set);
+		if ((i = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+			errno = i;
+			warn("could not pin the reader to CPU %d\r", thr.cpu);
+		}
+	}
+#endif
+	pfds[0].fd = thr.sfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = thr.stoppipe[0];
+	pfds[1].events = POLLIN;
+	while (!atomic_load(&thr.rxstop)) {
+		room = spsc_room(&thr.rx, iov);
+		rtsupdate(thr.sfd, thr.rx.size - room, thr.rx.size, &rtsoff);
+		if (room == 0 && qpolicy != QPOLICY_DROP) {
+			spsc_wait(&thr.rx, &thr.rxstop, rtsoff ? 10 : -1);
+			continue;
+		}
+		/* with RTS off, look at the fill level again now and then */
+		if (poll(pfds, 2, rtsoff ? 10 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			atomic_store(&thr.rxerr, errno);
+			break;
+		}
+		if (pfds[1].revents)
+			break;
+		if (pfds[0].revents == 0)
+			continue;
+		if (room == 0) {
+			/* drop policy: keep the UART drained regardless */
+			n = read(thr.sfd, scratch, sizeof(scratch));
+			if (n > 0)
+				thr.rx.dropped += n;
+		} else {
+			n = readv(thr.sfd, iov, iov[1].iov_len > 0 ? 2 : 1);
+			if (n > 0)
+				spsc_commit(&thr.rx, n);
+		}
+		if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+			atomic_store(&thr.rxerr, n == 0 ? -1 : errno);
+			break;
+		}
+		if (n > 0 && atomic_exchange(&thr.rxready, 1) == 0)
+			threadwake();
+	}
+	threadwake();
+	return NULL;
+}
+
+static void *
+outthread(void *arg)
+{
+	struct pollfd pfd;
+	struct iovec iov[2];
+	size_t len;
+	ssize_t n;
+
+	pfd.fd = STDOUT_FILENO;
+	pfd.events = POLLOUT;
+	for (;;) {
+		len = spsc_peek(&thr.out, iov);
+		if (len == 0) {
+			if (atomic_load(&thr.outstop))
+				break;
+			spsc_wait(&thr.out, &thr.outstop, -1);
+			continue;
+		}
+		n = writev(STDOUT_FILENO, iov, iov[1].iov_len > 0 ? 2 : 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* once stopping, give up on a terminal that does not drain */
+			if (errno == EAGAIN && (poll(&pfd, 1, 100) > 0 ||
+						!atomic_load(&thr.outstop)))
+				continue;
+			if (errno != EAGAIN) {
+				atomic_store(&thr.outerr, errno);
+				threadwake();
+			}
+			break;
+		}
+		if ((size_t)n < len)
+			thr.shortwrites++;
+		spsc_consume(&thr.out, n);
+		if (atomic_exchange(&thr.stalled, 0))
+			threadwake();
+	}
+	return NULL;
+}
+
+/*
+ * Pass what the reader thread received through rx_tap() on to the writer
+ * thread.  Unless old data may be dropped, take only as much as fits into
+ * thr.out, and leave it to the writer to wake us once there is room.
+ */
+static size_t
+threadroom(void)
+{
+	size_t room = hexspace(), reserve = hexreserve();
+
+	return room > reserve ? (room - reserve) / imap.grow : 0;
+}
+
+static void
+threadrx(int sfd)
+{
+	struct iovec iov[2];
+	size_t len, room;
+	int i;
+
+	atomic_store(&thr.rxready, 0);
+	for (;;) {
+		len = spsc_peek(&thr.rx, iov);
+		if (qpolicy != QPOLICY_DROP && len > (room = threadroom()))
+			len = room;
+		if (len > 0) {
+			st.rxchunks++;
+			for (i = 0, room = len; i < 2 && room > 0; i++) {
+				if (iov[i].iov_len > room)
+					iov[i].iov_len = room;
+				rx_tap(sfd, iov[i].iov_base, iov[i].iov_len);
+				if (imap.n > 0)
+					xfrun(&imap, iov[i].iov_base, iov[i].iov_len,
+							xsinkthr, -1);
+				else
+					spsc_put(&thr.out, iov[i].iov_base, iov[i].iov_len);
+				room -= iov[i].iov_len;
+			}
+			spsc_consume(&thr.rx, len);
+			continue;
+		}
+		if (qpolicy == QPOLICY_DROP ||
+				atomic_load(&thr.rx.tail) == atomic_load(&thr.rx.head))
+			break;
+		/* thr.out is full; recheck after telling the writer */
+		atomic_store(&thr.stalled, 1);
+		if (threadroom() == 0)
+			break;
+		atomic_store(&thr.stalled, 0);
+	}
+}
+
+static int
+threadloop(int sfd, struct console *con)
+{
+	struct pollfd pfds[4];
+	unsigned char buf[RELAYBUFSIZE];
+	ssize_t n;
+	int i, txms, ms, rv = 0;
+
+	if (pipe(thr.wake) || pipe(thr.stoppipe)) {
+		warn("pipe()");
+		return EX_OSERR;
+	}
+	fcntl(thr.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(thr.wake[1], F_SETFL, O_NONBLOCK);
+	thr.sfd = sfd;
+	spsc_init(&thr.rx, QUEUESIZE);
+	spsc_init(&thr.out, QUEUESIZE);
+	atomic_init(&thr.rxready, 0);
+	atomic_init(&thr.stalled, 0);
+	atomic_init(&thr.rxstop, 0);
+	atomic_init(&thr.outstop, 0);
+	atomic_init(&thr.rxerr, 0);
+	atomic_init(&thr.outerr, 0);
+	atomic_init(&thr.shortwrites, 0);
+	if ((i = pthread_create(&thr.outthread, NULL, outthread, NULL)) != 0 ||
+			(i = pthread_create(&thr.rxthread, NULL, rxthread, NULL)) != 0) {
+		errno = i;
+		err(EX_OSERR, "pthread_create()");
+	}
+
+	memset(pfds, 0, sizeof(pfds));
+	pfds[0].fd = STDIN_FILENO;
+	pfds[1].fd = thr.wake[0];
+	pfds[1].events = POLLIN;
+	pfds[2].fd = sfd;
+	pfds[3].events = POLLIN;
+	while (scrunning) {
+		txms = txwait();
+		ms = keywait();
+		if (txms > 0 && (ms < 0 || txms < ms))
+			ms = txms;
+		pfds[0].events = consoleroom(sizeof(buf)) ? POLLIN : 0;
+		pfds[2].events = txms == 0 ? POLLOUT : 0;
+		pfds[3].fd = ctlfd();
+		if ((i = poll(pfds, sizeof(pfds)/sizeof(pfds[0]), ms)) < 0) {
+			if (errno != EINTR) {
+				warn("poll()");
+				rv = EX_OSERR;
+				break;
+			}
+			pfds[0].revents = pfds[1].revents = pfds[2].revents = 0;
+			pfds[3].revents = 0;
+		}
+		st.wakeups++;
+		if (statsrequested) {
+			statsrequested = 0;
+			printstats();
+		}
+		if (pfds[0].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+			read(STDIN_FILENO, buf, 1);
+			warn("poll mask %04x read(tty)", pfds[0].revents);
+			rv = EX_OSERR;
+			break;
+		}
+
+		/* key sequences and pacing deadlines */
+		if ((keysend() + expectretry() > 0 || i == 0) && txflush(sfd) < 0) {
+			err(EX_OSERR, "could not write to serial device.");
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			n = read(STDIN_FILENO, buf, sizeof(buf));
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				err(EX_OSERR, "could not read from STDIN.");
+			}
+			if (n > 0) {
+				console_input(con, buf, n);
+			}
+			if (!scrunning)
+				break;
+		}
+		if (pfds[2].revents & POLLOUT) {
+			if (txflush(sfd) < 0) {
+				err(EX_OSERR, "could not write to serial device.");
+			}
+			txmarkdone();
+		}
+		if (pfds[3].revents)
+			ctlevent(sfd);
+		if (pfds[1].revents & POLLIN) {
+			while (read(thr.wake[0], buf, sizeof(buf)) > 0)
+				;
+			threadrx(sfd);
+			if ((i = atomic_load(&thr.rxerr)) != 0) {
+				errno = i > 0 ? i : EPIPE;
+				warn("could not read from serial device");
+				rv = EX_OSERR;
+				break;
+			}
+			if ((i = atomic_load(&thr.outerr)) != 0) {
+				errno = i;
+				warn("could not write to STDOUT");
+				rv = EX_OSERR;
+				break;
+			}
+		}
+	}
+
+	/* stop the reader, pass on what it got and let the writer finish */
+	atomic_store(&thr.rxstop, 1);
+	write(thr.stoppipe[1], "", 1);
+	pthread_mutex_lock(&thr.rx.lock);
+	pthread_cond_broadcast(&thr.rx.cond);
+	pthread_mutex_unlock(&thr.rx.lock);
+	pthread_join(thr.rxthread, NULL);
+	threadrx(sfd);
+	atomic_store(&thr.outstop, 1);
+	pthread_mutex_lock(&thr.out.lock);
+	pthread_cond_broadcast(&thr.out.cond);
+	pthread_mutex_unlock(&thr.out.lock);
+	pthread_join(thr.outthread, NULL);
+	close(thr.wake[0]);
+	close(thr.wake[1]);
+	close(thr.stoppipe[0]);
+	close(thr.stoppipe[1]);
+	free(thr.rx.buf);
+	free(thr.out.buf);
+	/* hexsent() and the like go back to outq */
+	thr.rx.buf = thr.out.buf = NULL;
+	return rv;
+}
+#endif
+
+static int
+loop(const int sfd, const int escchr)
+{
+	static struct console con;
+	unsigned char buf[RELAYBUFSIZE];
+	size_t room;
+	ssize_t n;
+	int i, outfl, txms, ms, rv = 0;
+
+	con.sfd = sfd;
+	con.escchr = escchr;
+	con.escapestate = ESCAPESTATE_WAITFOREC;
+
+	keystart();
+
+	/* each block read from the terminal may expand to txroom() */
+	queue_init(&outq, QUEUESIZE);
+	queue_init(&serq, QUEUESIZE > 2 * txroom(sizeof(buf)) ?
+			QUEUESIZE : 2 * txroom(sizeof(buf)));
+	if (render.rate > 0)
+		renderinit();
+
+	i = fcntl(sfd, F_GETFL);
+	if (i == -1 || fcntl(sfd, F_SETFL, i | O_NONBLOCK)) {
+		warn("fcntl() serial");
+		return EX_OSERR;
+	}
+	outfl = fcntl(STDOUT_FILENO, F_GETFL);
+	if (outfl != -1)
+		fcntl(STDOUT_FILENO, F_SETFL, outfl | O_NONBLOCK);
+
+	/* attached to a session: start with its scrollback */
+	if (shm != NULL)
+		ringfollow(sfd);
+
+	if (zflag) {
+#if defined(__linux__)
+		if (thr.enabled || render.rate > 0) {
+			if (!qflag)
+				warnx("using threads or --render, not using splice()\r");
+		} else if (sesslog.fd != -1 || caplog.fd != -1 || ac.nrules > 0 ||
+				imap.n > 0) {
+			if (!qflag)
+				warnx("logging, matching or mapping output, not using splice()\r");
+		} else if (isatty(STDOUT_FILENO)) {
+			if (!qflag)
+				warnx("stdout is a terminal, not using splice()\r");
+		} else if (pipe(spfd)) {
+			warn("pipe()");
+			spfd[0] = spfd[1] = -1;
+		} else {
+			/* spliced data is never seen */
+			historyinit(0);
+		}
+#else
+		warnx("splice() not available on this system\r");
+#endif
+	}
+
+#if !defined(HAS_BROKEN_POLL)
+	/* frames are paced by the poll() loop */
+	if (thr.enabled && render.rate > 0 && !qflag)
+		warnx("rendering output, not using threads\r");
+	if (thr.enabled && shm == NULL && render.rate == 0) {
+		rv = threadloop(sfd, &con);
+		goto done;
+	}
+#endif
+
+#if defined(HAS_IO_URING)
+	/* splicing and following a session ring are left to poll() */
+	if (useuring != 0 && spfd[0] == -1 && shm == NULL && render.rate == 0) {
+		if (uringopen() == 0) {
+			rv = uringloop(sfd, &con);
+			goto done;
+		}
+		if (useuring == 1)
+			warn("io_uring, using poll() instead\r");
+	}
+#endif
+
+#if defined(HAS_BROKEN_POLL)
+	while (scrunning) {
+		fd_set rfds, wfds;
+		struct timeval tv;
+		struct timeval *tvp = NULL;
+
+		txms = txwait();
+		ms = keywait();
+		if (txms > 0 && (ms < 0 || txms < ms))
+			ms = txms;
+		if ((i = renderwait()) > 0 && (ms < 0 || i < ms))
+			ms = i;
+		if (ms >= 0) {
+			tv.tv_sec = ms / 1000;
+			tv.tv_usec = (ms % 1000) * 1000;
+			tvp = &tv;
+		}
+
+		room = rxroom();
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		if (consoleroom(sizeof(buf)))
+			FD_SET(STDIN_FILENO, &rfds);
+		if (room > 0)
+			FD_SET(sfd, &rfds);
+		if (txms == 0)
+			FD_SET(sfd, &wfds);
+		if (outpending())
+			FD_SET(STDOUT_FILENO, &wfds);
+		if (ctlfd() != -1)
+			FD_SET(ctlfd(), &rfds);
+
+		if ((i = select((sfd > ctlfd() ? sfd : ctlfd()) + 1, &rfds, &wfds,
+						NULL, tvp)) < 0) {
+			if (errno != EINTR) {
+				warn("select()");
+				rv = EX_OSERR;
+				break;
+			}
+			FD_ZERO(&rfds);
+			FD_ZERO(&wfds);
+		}
+		st.wakeups++;
+		if (statsrequested) {
+			statsrequested = 0;
+			printstats();
+		}
+#else
+	struct pollfd pfds[4];
+
+	memset(pfds, 0, sizeof(pfds));
+	pfds[0].fd = STDIN_FILENO;
+	pfds[1].fd = sfd;
+	pfds[3].events = POLLIN;
+	while (scrunning) {
+		/*
+		 * Only read from the terminal if a whole block fits into serq,
+		 * and from the serial device as much as outq can take.
+		 */
+		room = rxroom();
+		txms = txwait();
+		ms = keywait();
+		if (txms > 0 && (ms < 0 || txms < ms))
+			ms = txms;
+		if ((i = renderwait()) > 0 && (ms < 0 || i < ms))
+			ms = i;
+		pfds[0].events = consoleroom(sizeof(buf)) ? POLLIN : 0;
+		pfds[1].events = (room > 0 ? POLLIN : 0) |
+			(txms == 0 ? POLLOUT : 0);
+		pfds[2].fd = outpending() ? STDOUT_FILENO : -1;
+		pfds[2].events = POLLOUT;
+		pfds[3].fd = ctlfd();
+		if ((i = poll(pfds, sizeof(pfds)/sizeof(pfds[0]), ms)) < 0) {
+			if (errno != EINTR) {
+				warn("poll()");
+				rv = EX_OSERR;
+				break;
+			}
+			pfds[0].revents = pfds[1].revents = pfds[2].revents = 0;
+			pfds[3].revents = 0;
+		}
+		st.wakeups++;
+		if (statsrequested) {
+			statsrequested = 0;
+			printstats();
+		}
+		if ((pfds[0].revents | pfds[1].revents) & POLLNVAL) {
+			warnx("poll() does not support devices");
+			rv = EX_OSERR;
+			break;
+		}
+		if (pfds[0].revents & (POLLERR|POLLHUP)) {
+			read(STDIN_FILENO, buf, 1);
+			warn("poll mask %04x read(tty)", pfds[0].revents);
+			rv = EX_OSERR;
+			break;
+		}
+		if (pfds[1].revents & (POLLERR|POLLHUP)) {
+			read(sfd, buf, 1);
+			warn("poll mask %04x read(serial)", pfds[1].revents);
+			rv = EX_OSERR;
+			break;
+		}
+		if (pfds[2].revents & (POLLERR|POLLHUP)) {
+			warnx("poll mask %04x write(stdout)", pfds[2].revents);
+			rv = EX_OSERR;
+			break;
+		}
+#endif
+
+		/* key sequences and pacing deadlines */
+		if ((keysend() + expectretry() > 0 || i == 0) && txflush(sfd) < 0) {
+			err(EX_OSERR, "could not write to serial device.");
+		}
+
+#if defined(HAS_BROKEN_POLL)
+		if (FD_ISSET(STDIN_FILENO, &rfds)) {
+#else
+		if (pfds[0].revents & POLLIN) {
+#endif
+			n = read(STDIN_FILENO, buf, sizeof(buf));
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				err(EX_OSERR, "could not read from STDIN.");
+			}
+			if (n > 0) {
+				console_input(&con, buf, n);
+			}
+			if (!scrunning)
+				break;
+		}
+#if defined(HAS_BROKEN_POLL)
+		if (FD_ISSET(sfd, &wfds)) {
+#else
+		if (pfds[1].revents & POLLOUT) {
+#endif
+			if (txflush(sfd) < 0) {
+				err(EX_OSERR, "could not write to serial device.");
+			}
+			txmarkdone();
+		}
+#if defined(HAS_BROKEN_POLL)
+		if (FD_ISSET(sfd, &rfds)) {
+#else
+		if (pfds[1].revents & POLLIN) {
+#endif
+#if defined(__linux__)
+			if (spfd[0] != -1 && splicein(sfd) >= 0) {
+				outflush(sfd);
+				continue;
+			}
+#endif
+			if (shm != NULL) {
+				ringfollow(sfd);
+				continue;
+			}
+			n = read(sfd, buf, room < sizeof(buf) ? room : sizeof(buf));
+			if (n < 0 && errno != EINTR && errno != EAGAIN) {
+				err(EX_OSERR, "could not read from serial device.");
+			}
+			if (n > 0) {
+				rx_data(sfd, buf, n);
+			}
+		}
+#if defined(HAS_BROKEN_POLL)
+		if (FD_ISSET(STDOUT_FILENO, &wfds)) {
+#else
+		if (pfds[2].revents & POLLOUT) {
+#endif
+			outflush(sfd);
+		}
+#if defined(HAS_BROKEN_POLL)
+		if (ctlfd() != -1 && FD_ISSET(ctlfd(), &rfds)) {
+#else
+		if (pfds[3].revents) {
+#endif
+			ctlevent(sfd);
+		}
+	}
+
+#if !defined(HAS_BROKEN_POLL)
+done:
+#endif
+	/* send what was typed before the disconnect, and what fits to stdout */
+	if ((i = txdrain(sfd, DRAINTIMEOUT)) < 0)
+		warn("could not write to serial device");
+	else if (i > 0 && queue_len(&serq) > 0)
+		warnx("%zu bytes not sent to the serial device", queue_len(&serq));
+	queue_flush(&outq, STDOUT_FILENO);
+	if (rtsoff)
+		rtscontrol(sfd, 1);
+	if (outfl != -1)
+		fcntl(STDOUT_FILENO, F_SETFL, outfl);
+#if defined(__linux__)
+	if (spfd[0] != -1) {
+		spliceout();
+		close(spfd[0]);
+		close(spfd[1]);
+	}
+#endif
+	if (!qflag || outq.dropped > 0 || atomic_load(&rtsthrottled) > 0) {
+		fprintf(stderr, "\r\n");
+		printstats();
+	}
+	return(rv);
+}
+
+/*
+ * TCP server mode (--listen): any number of clients share the device.
+ * Its output is read straight into outq, which is used as a ring that is
+ * never drained.  Every client has its own position in it and is written
+ * from there, so nothing is copied per client.  A client that falls a
+ * whole ring behind is disconnected rather than allowed to hold up the
+ * device.  Only the client that has been connected longest may write to
+ * the device; what the others send is discarded.
+ */
+#define MAXCLIENTS	64
+
+struct client {
+	int fd;
+	size_t pos;		/* next outq position to send */
+	char name[NI_MAXHOST + NI_MAXSERV + 3];
+};
+
+static struct client clients[MAXCLIENTS];
+static int nclients;
+
+/*
+ * Listen on host:port; an empty host or "*" means all addresses, and an
+ * IPv6 address can be put in brackets.  "unix:path" listens on a UNIX
+ * socket, unless another process is already listening there.
+ */
+static int
+listensock(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd = -1, on = 1, i;
+
+	if (strncmp(addr, "unix:", 5) == 0) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+			warnx("%s: path too long", addr);
+			return -1;
+		}
+		strcpy(sun.sun_path, addr + 5);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			warn("socket()");
+			return -1;
+		}
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+			warnx("%s is in use", addr + 5);
+			close(fd);
+			return -1;
+		}
+		unlink(sun.sun_path);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 16)) {
+			warn("listen on %s", addr + 5);
+			close(fd);
+			return -1;
+		}
+		goto nonblock;
+	}
+	if ((host = strdup(addr)) == NULL)
+		err(EX_OSERR, "strdup()");
+	if ((port = strrchr(host, ':')) == NULL) {
+		warnx("listen address \"%s\" is not host:port", addr);
+		free(host);
+		return -1;
+	}
+	*port++ = '\0';
+	if (host[0] == '[' && port - host > 2 && port[-2] == ']') {
+		port[-2] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	i = getaddrinfo(*host == '\0' || strcmp(host, "*") == 0 ? NULL : host,
+			port, &hints, &res);
+	if (i != 0) {
+		warnx("%s: %s", addr, gai_strerror(i));
+		free(host);
+		return -1;
+	}
+	free(host);
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		warn("listen on %s", addr);
+		return -1;
+	}
+nonblock:
+	i = fcntl(fd, F_GETFL);
+	if (i != -1)
+		fcntl(fd, F_SETFL, i | O_NONBLOCK);
+	return fd;
+}
+
+static void
+clientadd(int lfd)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	struct client *c;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	int fd, i, on = 1;
+
+	if ((fd = accept(lfd, (struct sockaddr *)&ss, &sslen)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+				errno != ECONNABORTED)
+			warn("accept()");
+		return;
+	}
+	i = fcntl(fd, F_GETFL);
+	if (i == -1 || fcntl(fd, F_SETFL, i | O_NONBLOCK)) {
+		warn("fcntl() client");
+		close(fd);
+		return;
+	}
+	if (ss.ss_family != AF_UNIX)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	c = &clients[nclients++];
+	c->fd = fd;
+	c->pos = outq.tail;
+	if (ss.ss_family == AF_UNIX)
+		snprintf(c->name, sizeof(c->name), "client %d", fd);
+	else if (getnameinfo((struct sockaddr *)&ss, sslen, host, sizeof(host),
+			serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		strcpy(c->name, "?");
+	else
+		snprintf(c->name, sizeof(c->name), ss.ss_family == AF_INET6 ?
+				"[%s]:%s" : "%s:%s", host, serv);
+	if (!qflag)
+		fprintf(stderr, "%s connected%s\n", c->name,
+				nclients == 1 ? ", may write" : ", read only");
+}
+
+static void
+clientdrop(int i, const char *why)
+{
+	if (!qflag)
+		fprintf(stderr, "%s %s\n", clients[i].name, why);
+	close(clients[i].fd);
+	memmove(&clients[i], &clients[i + 1], (nclients - i - 1) * sizeof(clients[0]));
+	nclients--;
+	if (i == 0 && nclients > 0 && !qflag)
+		fprintf(stderr, "%s may write now\n", clients[0].name);
+}
+
+/*
+ * Send a client what it has not seen yet from outq.  Attached clients
+ * read it from the shared ring themselves and just get woken up.
+ */
+static int
+clientflush(struct client *c)
+{
+	struct iovec iov[2];
+	ssize_t n;
+
+	if (shm != NULL && c->pos != outq.tail) {
+		c->pos = outq.tail;
+		if (write(c->fd, "", 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		return 0;
+	}
+	while (c->pos != outq.tail) {
+		n = writev(c->fd, iov, queue_iov(&outq, c->pos, outq.tail - c->pos, iov));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		c->pos += n;
+	}
+	return 0;
+}
+
+static int
+serve(int sfd, int lfd)
+{
+	unsigned char buf[RELAYBUFSIZE];
+	struct pollfd pfds[3 + MAXCLIENTS];
+	struct iovec iov[2];
+	int i, j, k, n, ms, txms, rv = 0;
+	ssize_t len;
+
+	if (outq.buf == NULL)
+		queue_init(&outq, QUEUESIZE);
+	queue_init(&serq, QUEUESIZE > 4 * sizeof(buf) ? QUEUESIZE : 4 * sizeof(buf));
+	/* outq is shared by the clients; only what is received gets dumped */
+	hexview.on = 0;
+	i = fcntl(sfd, F_GETFL);
+	if (i == -1 || fcntl(sfd, F_SETFL, i | O_NONBLOCK)) {
+		warn("fcntl() serial");
+		close(lfd);
+		return EX_OSERR;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	keystart();
+
+	while (scrunning) {
+		txms = txwait();
+		ms = keywait();
+		if (txms > 0 && (ms < 0 || txms < ms))
+			ms = txms;
+		pfds[0].fd = lfd;
+		pfds[0].events = nclients < MAXCLIENTS ? POLLIN : 0;
+		pfds[1].fd = sfd;
+		pfds[1].events = POLLIN | (txms == 0 ? POLLOUT : 0);
+		for (j = 0; j < nclients; j++) {
+			pfds[2 + j].fd = clients[j].fd;
+			pfds[2 + j].events = (clients[j].pos != outq.tail ? POLLOUT : 0) |
+				(j > 0 || queue_space(&serq) >= sizeof(buf) ? POLLIN : 0);
+		}
+		n = nclients;
+		pfds[2 + n].fd = ctlfd();
+		pfds[2 + n].events = POLLIN;
+		if ((i = poll(pfds, 3 + n, ms)) < 0) {
+			if (errno != EINTR) {
+				warn("poll()");
+				rv = EX_OSERR;
+				break;
+			}
+			for (j = 0; j < 3 + n; j++)
+				pfds[j].revents = 0;
+		}
+		st.wakeups++;
+		if (statsrequested) {
+			statsrequested = 0;
+			printstats();
+		}
+		if ((keysend() + expectretry() > 0 || i == 0) && txflush(sfd) < 0) {
+			err(EX_OSERR, "could not write to serial device.");
+		}
+		if (pfds[1].revents & POLLOUT) {
+			if (txflush(sfd) < 0) {
+				err(EX_OSERR, "could not write to serial device.");
+			}
+		}
+		/* descending, so dropping a client does not move those still to do */
+		for (j = n - 1; j >= 0; j--) {
+			struct client *c = &clients[j];
+
+			if (pfds[2 + j].revents == 0)
+				continue;
+			if (pfds[2 + j].revents & POLLOUT && clientflush(c) < 0) {
+				clientdrop(j, "lost");
+				continue;
+			}
+			if (!(pfds[2 + j].revents & (POLLIN|POLLERR|POLLHUP)))
+				continue;
+			len = read(c->fd, buf, sizeof(buf));
+			if (len < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (len <= 0) {
+				clientdrop(j, "disconnected");
+				continue;
+			}
+			if (j == 0) {
+				st.txchunks++;
+				txwrite(sfd, buf, len);
+			}
+		}
+		if (pfds[1].revents & POLLIN) {
+			k = queue_iov(&outq, outq.tail, sizeof(buf), iov);
+			len = readv(sfd, iov, k);
+			if (len < 0 && errno != EINTR && errno != EAGAIN) {
+				err(EX_OSERR, "could not read from serial device.");
+			}
+			if (len > 0) {
+				st.rxchunks++;
+				for (j = 0; j < k && len > 0; j++) {
+					size_t l = (size_t)len < iov[j].iov_len ? (size_t)len : iov[j].iov_len;
+
+					rx_tap(sfd, iov[j].iov_base, l);
+					outq.tail += l;
+					len -= l;
+				}
+				if (outq.tail - outq.head > outq.size)
+					outq.head = outq.tail - outq.size;
+				if (shm != NULL)
+					atomic_store_explicit(&shm->tail, outq.tail, memory_order_release);
+				/* the read overwrote the oldest data */
+				for (j = nclients - 1; j >= 0; j--) {
+					if (outq.tail - clients[j].pos > outq.size)
+						clientdrop(j, "fell behind, disconnected");
+					else if (clientflush(&clients[j]) < 0)
+						clientdrop(j, "lost");
+				}
+			}
+		} else if (pfds[1].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+			warnx("poll mask %04x on serial device", pfds[1].revents);
+			rv = EX_OSERR;
+			break;
+		}
+		if (pfds[0].revents & POLLIN)
+			clientadd(lfd);
+		if (pfds[2 + n].revents)
+			ctlevent(sfd);
+	}
+
+	while (nclients > 0)
+		clientdrop(nclients - 1, "closed");
+	close(lfd);
+	if ((i = txdrain(sfd, DRAINTIMEOUT)) < 0)
+		warn("could not write to serial device");
+	else if (i > 0 && queue_len(&serq) > 0)
+		warnx("%zu bytes not sent to the serial device", queue_len(&serq));
+	if (!qflag)
+		printstats();
+	if (shm == NULL)
+		free(outq.buf);
+	free(serq.buf);
+	return rv;
+}
+
+/*
+ * Where the files of a session live: name itself if it contains a '/',
+ * otherwise $TMPDIR/sc-uid/name.
+ */
+static char *
+sessionpath(const char *name, const char *suffix)
+{
+	const char *tmp = getenv("TMPDIR");
+	struct stat sb;
+	char *path;
+
+	if (strchr(name, '/') != NULL) {
+		if (asprintf(&path, "%s%s", name, suffix) < 0)
+			err(EX_OSERR, "asprintf()");
+		return path;
+	}
+	if (tmp == NULL || *tmp == '\0')
+		tmp = "/tmp";
+	if (asprintf(&path, "%s/sc-%ld", tmp, (long)getuid()) < 0)
+		err(EX_OSERR, "asprintf()");
+	if (mkdir(path, 0700) && errno != EEXIST)
+		err(EX_CANTCREAT, "mkdir %s", path);
+	/* anyone could have made it first, to get at our sessions */
+	if (lstat(path, &sb))
+		err(EX_OSERR, "%s", path);
+	if (!S_ISDIR(sb.st_mode) || sb.st_uid != getuid() ||
+			(sb.st_mode & 077) != 0)
+		errx(EX_NOPERM, "%s: not a directory of ours with mode 0700", path);
+	free(path);
+	if (asprintf(&path, "%s/sc-%ld/%s%s", tmp, (long)getuid(), name, suffix) < 0)
+		err(EX_OSERR, "asprintf()");
+	return path;
+}
+
+/*
+ * Set up session name, keeping size bytes of output, and go to the
+ * background.  Returns the socket to serve() on.
+ */
+static int
+sessionopen(const char *name, size_t size)
+{
+	char *ringfn = sessionpath(name, ".ring");
+	char *sockfn = sessionpath(name, ".sock");
+	char *addr;
+	int fd, lfd;
+
+	if (size == 0)
+		size = QUEUESIZE;
+	else if (size < 4 * RELAYBUFSIZE)
+		size = 4 * RELAYBUFSIZE;
+	for (outq.size = 1; outq.size < size; outq.size <<= 1)
+		;
+	if (asprintf(&addr, "unix:%s", sockfn) < 0)
+		err(EX_OSERR, "asprintf()");
+	lfd = listensock(addr);
+	free(addr);
+	if (lfd < 0)
+		goto out;
+	fd = open(ringfn, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	if (fd < 0 || ftruncate(fd, RINGDATA + outq.size)) {
+		warn("%s", ringfn);
+		goto fail;
+	}
+	shm = mmap(NULL, RINGDATA + outq.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		warn("mmap %s", ringfn);
+		shm = NULL;
+		goto fail;
+	}
+	memcpy(shm->magic, RINGMAGIC, sizeof(shm->magic));
+	shm->size = outq.size;
+	atomic_store(&shm->tail, 0);
+	outq.buf = shmdata();
+	if (!qflag)
+		fprintf(stderr, "Session %s, attach with: sc attach %s\n", name, name);
+	if (daemon(1, 0) == 0)
+		goto out;
+	warn("daemon()");
+fail:
+	close(lfd);
+	lfd = -1;
+	unlink(sockfn);
+	unlink(ringfn);
+out:
+	free(ringfn);
+	free(sockfn);
+	return lfd;
+}
+
+static void
+sessionclose(const char *name)
+{
+	char *fn;
+
+	fn = sessionpath(name, ".sock");
+	unlink(fn);
+	free(fn);
+	fn = sessionpath(name, ".ring");
+	unlink(fn);
+	free(fn);
+	munmap(shm, RINGDATA + shm->size);
+	shm = NULL;
+}
+
+/*
+ * Listen for control connections on path, or on <name>.ctl next to the
+ * session sockets if it has no '/'.
+ */
+static int
+ctlopen(const char *path)
+{
+	char *addr;
+
+	ctl.path = sessionpath(path, strchr(path, '/') != NULL ? "" : ".ctl");
+	if (asprintf(&addr, "unix:%s", ctl.path) < 0)
+		err(EX_OSERR, "asprintf()");
+	ctl.lfd = listensock(addr);
+	free(addr);
+	if (ctl.lfd < 0) {
+		free(ctl.path);
+		ctl.path = NULL;
+		return -1;
+	}
+	/* a client gone before its reply must not take sc down */
+	signal(SIGPIPE, SIG_IGN);
+	return 0;
+}
+
+static void
+ctlclose(void)
+{
+	if (ctl.fd != -1)
+		ctldrop();
+	if (ctl.lfd == -1)
+		return;
+	close(ctl.lfd);
+	ctl.lfd = -1;
+	unlink(ctl.path);
+	free(ctl.path);
+	ctl.path = NULL;
+}
+
+/*
+ * Connect the terminal to session name, starting with up to scrollback
+ * bytes of its past output (all that is kept if 0).
+ */
+static int
+attach(const char *name, int escchr, size_t scrollback)
+{
+	struct sockaddr_un sun;
+	struct termios consoleti, tempti;
+	struct stat sb;
+	char *ringfn = sessionpath(name, ".ring");
+	char *sockfn = sessionpath(name, ".sock");
+	uint64_t tail;
+	int fd, sfd, i, ec;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(sockfn) >= sizeof(sun.sun_path))
+		errx(EX_USAGE, "%s: path too long", sockfn);
+	strcpy(sun.sun_path, sockfn);
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			connect(sfd, (struct sockaddr *)&sun, sizeof(sun))) {
+		warn("session %s", name);
+		return EX_UNAVAILABLE;
+	}
+	if ((fd = open(ringfn, O_RDONLY | O_NOFOLLOW)) < 0 || fstat(fd, &sb)) {
+		warn("%s", ringfn);
+		return EX_NOINPUT;
+	}
+	shm = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED || sb.st_size < RINGDATA ||
+			memcmp(shm->magic, RINGMAGIC, sizeof(shm->magic)) != 0 ||
+			(uint64_t)sb.st_size != RINGDATA + shm->size) {
+		warnx("%s: not a session ring", ringfn);
+		return EX_DATAERR;
+	}
+	tail = atomic_load(&shm->tail);
+	if (scrollback == 0 || scrollback > shm->size - RELAYBUFSIZE)
+		scrollback = shm->size - RELAYBUFSIZE;
+	shmpos = tail > scrollback ? tail - scrollback : 0;
+	free(ringfn);
+	free(sockfn);
+
+	if (tcgetattr(STDIN_FILENO, &consoleti))
+		err(EX_OSERR, "tcgetattr() tty");
+	signal(SIGHUP, sighandler);
+	signal(SIGINT, sighandler);
+	signal(SIGQUIT, sighandler);
+	signal(SIGTERM, sighandler);
+	signal(SIGUSR1, siginfohandler);
+	signal(SIGPIPE, SIG_IGN);
+	if (!qflag)
+		fprintf(stderr, "Attached to session %s\n", name);
+	i = fcntl(STDIN_FILENO, F_GETFL);
+	if (i == -1 || fcntl(STDIN_FILENO, F_SETFL, i | O_NONBLOCK))
+		err(EX_OSERR, "fcntl() tty");
+	memcpy(&tempti, &consoleti, sizeof(tempti));
+	cfmakeraw(&tempti);
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &tempti)) {
+		warn("tcsetattr() tty");
+		return EX_OSERR;
+	}
+	ec = loop(sfd, escchr);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &consoleti);
+	close(sfd);
+	fprintf(stderr, "\n");
+	if (!qflag) fprintf(stderr, "Detached.\n");
+	return ec;
+}
+
+/*
+ * Low latency mode (--low-latency): ask the driver to push received data
+ * to the tty layer right away instead of batching it (USB serial adapters
+ * shorten their latency timer to 1 ms), and with a priority, run at that
+ * SCHED_FIFO priority with all memory locked.  Everything is undone by
+ * lowlatencyoff().
+ */
+static struct {
+	int serialflags;	/* the driver's flags before, or -1 */
+	int policy;		/* scheduling before, or -1 */
+	struct sched_param param;
+	int locked;
+} llsaved = { -1, -1 };
+
+static void
+lowlatencyon(int sfd, const char *tty)
+{
+#if defined(__linux__)
+	struct serial_struct ss;
+	struct sched_param param;
+
+	if (ioctl(sfd, TIOCGSERIAL, &ss) == 0) {
+		llsaved.serialflags = ss.flags;
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(sfd, TIOCSSERIAL, &ss) < 0) {
+			warn("TIOCSSERIAL(%s)", tty);
+			llsaved.serialflags = -1;
+		}
+	} else if (!qflag) {
+		warnx("%s has no low latency setting", tty);
+	}
+	if (lowlat == 0)
+		return;
+	llsaved.policy = sched_getscheduler(0);
+	sched_getparam(0, &llsaved.param);
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = lowlat;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+		warn("SCHED_FIFO priority %d", lowlat);
+		llsaved.policy = -1;
+	}
+	/* the history copes with allocations failing over RLIMIT_MEMLOCK */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		warn("mlockall()");
+	else
+		llsaved.locked = 1;
+#else
+	warnx("low latency mode is not supported on this system");
+#endif
+}
+
+static void
+lowlatencyoff(int sfd)
+{
+#if defined(__linux__)
+	struct serial_struct ss;
+
+	if (llsaved.serialflags != -1 && ioctl(sfd, TIOCGSERIAL, &ss) == 0) {
+		ss.flags = llsaved.serialflags;
+		ioctl(sfd, TIOCSSERIAL, &ss);
+	}
+	if (llsaved.policy != -1)
+		sched_setscheduler(0, llsaved.policy, &llsaved.param);
+	if (llsaved.locked)
+		munlockall();
+	llsaved.serialflags = llsaved.policy = -1;
+	llsaved.locked = 0;
+#endif
+}
+
+
+/*
+ * Multi-port mode: a single process relays the output of many serial
+ * devices, each to its own sink.  There is no terminal; ports are set up
+ * from specifications of the form
+ *	device[,speed[,parms]]=sink
+ * where sink is a file name (appended to), "unix:path" or "tcp:host:port".
+ */
+struct port {
+	char *tty;
+	int sfd;
+	int sink;
+	int rxarmed;		/* serial device is polled for input */
+	int txarmed;		/* sink is polled for output */
+	int rtsoff;
+	struct queue q;
+	struct termios saved;
+};
+
+static struct port *ports;
+static int nports;
+
+static char *
+devpath(const char *tty)
+{
+	char *path;
+
+	if (strchr(tty, '/') != NULL)
+		return strdup(tty);
+	if (strlen(path_dev) + strlen(tty) > PATH_MAX) {
+		errx(EX_USAGE, "Device name \"%s\" is too long.", tty);
+	}
+	if (asprintf(&path, "%s%s", path_dev, tty) < 0)
+		return NULL;
+	return path;
+}
+
+static int
+opensink(const char *sink)
+{
+	int fd, i;
+
+	if (strncmp(sink, "unix:", 5) == 0) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(sink + 5) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(sun.sun_path, sink + 5);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+			close(fd);
+			return -1;
+		}
+	} else if (strncmp(sink, "tcp:", 4) == 0) {
+		struct addrinfo hints, *res, *ai;
+		char *host, *port;
+
+		if ((host = strdup(sink + 4)) == NULL)
+			return -1;
+		if ((port = strrchr(host, ':')) == NULL) {
+			free(host);
+			errno = EINVAL;
+			return -1;
+		}
+		*port++ = '\0';
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if ((i = getaddrinfo(host, port, &hints, &res)) != 0) {
+			warnx("%s: %s", sink, gai_strerror(i));
+			free(host);
+			errno = EHOSTUNREACH;
+			return -1;
+		}
+		free(host);
+		fd = -1;
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+				continue;
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd < 0)
+			return -1;
+	} else {
+		if ((fd = open(sink, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+			return -1;
+	}
+	i = fcntl(fd, F_GETFL);
+	if (i != -1)
+		fcntl(fd, F_SETFL, i | O_NONBLOCK);
+	return fd;
+}
+
+/*
+ * Open and configure the port described by spec using parsespeed() and
+ * parseparms(), with speed and parms as defaults.
+ */
+static int
+addport(char *spec, char *speed, char *parms, int fflag, int mflag)
+{
+	struct port *p;
+	struct termios ti;
+	char *sink, *s;
+	int ec;
+
+	if ((sink = strchr(spec, '=')) == NULL || sink[1] == '\0') {
+		warnx("Invalid port specification \"%s\": no sink", spec);
+		return EX_USAGE;
+	}
+	*sink++ = '\0';
+	if ((s = strchr(spec, ',')) != NULL) {
+		*s++ = '\0';
+		speed = s;
+		if ((s = strchr(s, ',')) != NULL) {
+			*s++ = '\0';
+			parms = s;
+		}
+	}
+
+	p = realloc(ports, (nports + 1) * sizeof(*ports));
+	if (p == NULL)
+		err(EX_OSERR, "realloc()");
+	ports = p;
+	p = &ports[nports];
+	memset(p, 0, sizeof(*p));
+	p->sink = -1;
+	if ((p->tty = devpath(spec)) == NULL)
+		err(EX_OSERR, "malloc()");
+	p->sfd = open(p->tty, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (p->sfd < 0) {
+		warn("open %s", p->tty);
+		return EX_OSERR;
+	}
+	if (tcgetattr(p->sfd, &p->saved)) {
+		warn("tcgetattr(%s)", p->tty);
+		close(p->sfd);
+		return EX_OSERR;
+	}
+	memcpy(&ti, &p->saved, sizeof(ti));
+	if ((ec = serialsetup(p->sfd, p->tty, &ti, speed, parms, fflag, mflag)) != 0) {
+		tcsetattr(p->sfd, TCSAFLUSH, &p->saved);
+		close(p->sfd);
+		return ec;
+	}
+	if ((p->sink = opensink(sink)) < 0) {
+		warn("%s: sink %s", p->tty, sink);
+		tcsetattr(p->sfd, TCSAFLUSH, &p->saved);
+		close(p->sfd);
+		return EX_OSERR;
+	}
+	queue_init(&p->q, PORTQUEUESIZE);
+	modemcontrol(p->sfd, 1);
+	if (!qflag && tcgetattr(p->sfd, &ti) == 0)
+		printparms(&ti, p->sfd, p->tty, speed);
+	nports++;
+	return 0;
+}
+
+/*
+ * Read port specifications from a file, one per line.  Empty lines and
+ * everything after a '#' are ignored.
+ */
+static int
+addportfile(const char *fn, char *speed, char *parms, int fflag, int mflag)
+{
+	FILE *f;
+	char *line = NULL, *s, *e;
+	size_t linesize = 0;
+	int ec = 0;
+
+	if ((f = fopen(fn, "r")) == NULL) {
+		warn("%s", fn);
+		return EX_NOINPUT;
+	}
+	while (ec == 0 && getline(&line, &linesize, f) != -1) {
+		if ((s = strchr(line, '#')) != NULL)
+			*s = '\0';
+		for (s = line; isspace((unsigned char)*s); s++)
+			;
+		for (e = s + strlen(s); e > s && isspace((unsigned char)e[-1]); e--)
+			;
+		*e = '\0';
+		if (*s == '\0')
+			continue;
+		if ((s = strdup(s)) == NULL)
+			err(EX_OSERR, "strdup()");
+		ec = addport(s, speed, parms, fflag, mflag);
+	}
+	free(line);
+	fclose(f);
+	return ec;
+}
+
+#if defined(__linux__)
+#define PORTEV_SERIAL	0
+#define PORTEV_SINK	1
+
+static void
+portarm(int epfd, struct port *p, int rx, int tx)
+{
+	struct epoll_event ev;
+
+	if (rx != p->rxarmed) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = rx ? EPOLLIN : 0;
+		ev.data.u64 = (uint64_t)(p - ports) << 1 | PORTEV_SERIAL;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, p->sfd, &ev);
+		p->rxarmed = rx;
+	}
+	if (tx != p->txarmed && p->sink != -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = tx ? EPOLLOUT : 0;
+		ev.data.u64 = (uint64_t)(p - ports) << 1 | PORTEV_SINK;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, p->sink, &ev);
+		p->txarmed = tx;
+	}
+}
+#endif
+
+static void
+portsinkclose(struct port *p, const char *what)
+{
+	warn("%s: %s sink, discarding output", p->tty, what);
+	close(p->sink);
+	p->sink = -1;
+	p->q.head = p->q.tail;
+}
+
+/*
+ * Move data from a readable port to its sink.  Returns -1 if the port is
+ * gone, e.g. a USB adapter was unplugged: a hung up tty stays readable
+ * and read() returns 0, so it has to be closed to not spin on it.
+ */
+static int
+portread(struct port *p, unsigned char *buf, size_t bufsize)
+{
+	ssize_t n;
+	size_t room = bufsize;
+
+	if (qpolicy != QPOLICY_DROP && queue_space(&p->q) < room)
+		room = queue_space(&p->q);
+	if (room == 0)
+		return 0;
+	n = read(p->sfd, buf, room);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (n < 0) {
+		warn("read(%s), closing port", p->tty);
+		return -1;
+	}
+	if (n == 0) {
+		warnx("%s: hung up, closing port", p->tty);
+		return -1;
+	}
+	if (p->sink == -1)
+		return 0;
+	if (queue_write(&p->q, p->sink, buf, n) < 0)
+		portsinkclose(p, "write to");
+	rtsupdate(p->sfd, queue_len(&p->q), p->q.size, &p->rtsoff);
+	return 0;
+}
+
+static void
+portwrite(struct port *p)
+{
+	if (p->sink != -1 && queue_flush(&p->q, p->sink) < 0)
+		portsinkclose(p, "write to");
+	rtsupdate(p->sfd, queue_len(&p->q), p->q.size, &p->rtsoff);
+}
+
+static int
+multiloop(void)
+{
+	unsigned char buf[RELAYBUFSIZE];
+	struct port *p;
+	int i, n;
+#if defined(__linux__)
+	struct epoll_event evs[256], ev;
+	int epfd;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		warn("epoll_create1()");
+		return EX_OSERR;
+	}
+	for (p = ports; p < ports + nports; p++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)(p - ports) << 1 | PORTEV_SERIAL;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->sfd, &ev)) {
+			warn("epoll_ctl(%s)", p->tty);
+			return EX_OSERR;
+		}
+		p->rxarmed = 1;
+		ev.events = 0;
+		ev.data.u64 = (uint64_t)(p - ports) << 1 | PORTEV_SINK;
+		/* regular files can't be polled, they are always writable */
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->sink, &ev) && errno != EPERM) {
+			warn("epoll_ctl(%s sink)", p->tty);
+			return EX_OSERR;
+		}
+	}
+	while (scrunning) {
+		n = epoll_wait(epfd, evs, sizeof(evs)/sizeof(evs[0]), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("epoll_wait()");
+			close(epfd);
+			return EX_OSERR;
+		}
+		for (i = 0; i < n; i++) {
+			p = &ports[evs[i].data.u64 >> 1];
+			if ((evs[i].data.u64 & 1) == PORTEV_SINK) {
+				if (evs[i].events & (EPOLLERR|EPOLLHUP))
+					portsinkclose(p, "lost");
+				else
+					portwrite(p);
+			} else if (evs[i].events & EPOLLIN) {
+				if (portread(p, buf, sizeof(buf)) < 0)
+					p->rxarmed = -1;
+			} else if (evs[i].events & (EPOLLERR|EPOLLHUP)) {
+				warnx("%s: poll mask %04x, closing port", p->tty, evs[i].events);
+				p->rxarmed = -1;
+			}
+			if (p->rxarmed == -1) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, p->sfd, NULL);
+				continue;
+			}
+			/* with a full queue, leave the data in the device */
+			portarm(epfd, p, qpolicy == QPOLICY_DROP || queue_space(&p->q) > 0,
+					queue_len(&p->q) > 0);
+		}
+	}
+	close(epfd);
+#else
+	struct pollfd *pfds;
+
+	if ((pfds = calloc(2 * nports, sizeof(*pfds))) == NULL)
+		err(EX_OSERR, "calloc()");
+	while (scrunning) {
+		for (i = 0, p = ports; p < ports + nports; i += 2, p++) {
+			pfds[i].fd = p->rxarmed == -1 ? -1 : p->sfd;
+			pfds[i].events = qpolicy == QPOLICY_DROP ||
+				queue_space(&p->q) > 0 ? POLLIN : 0;
+			pfds[i+1].fd = queue_len(&p->q) > 0 ? p->sink : -1;
+			pfds[i+1].events = POLLOUT;
+		}
+		if (poll(pfds, 2 * nports, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("poll()");
+			free(pfds);
+			return EX_OSERR;
+		}
+		for (i = 0, p = ports; p < ports + nports; i += 2, p++) {
+			if (pfds[i].revents & POLLIN) {
+				if (portread(p, buf, sizeof(buf)) < 0)
+					p->rxarmed = -1;
+			} else if (pfds[i].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+				warnx("%s: poll mask %04x, closing port", p->tty, pfds[i].revents);
+				p->rxarmed = -1;
+			}
+			if (pfds[i+1].revents & (POLLERR|POLLHUP))
+				portsinkclose(p, "lost");
+			else if (pfds[i+1].revents & POLLOUT)
+				portwrite(p);
+		}
+	}
+	free(pfds);
+#endif
+	return 0;
+}
+
+/*
+ * Every port needs two descriptors; the default soft limit of 1024 is
+ * too low for a console server.
+ */
+static void
+raisenofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+static int
+multiport(int ec)
+{
+	struct port *p;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, sighandler);
+	signal(SIGINT, sighandler);
+	signal(SIGQUIT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	if (ec == 0)
+		ec = multiloop();
+
+	for (p = ports; p < ports + nports; p++) {
+		if (p->sink != -1) {
+			queue_flush(&p->q, p->sink);
+			close(p->sink);
+		}
+		if (p->q.dropped > 0)
+			warnx("%s: %llu bytes of output dropped", p->tty, p->q.dropped);
+		if (p->rtsoff)
+			rtscontrol(p->sfd, 1);
+		modemcontrol(p->sfd, 0);
+		tcsetattr(p->sfd, TCSAFLUSH, &p->saved);
+		close(p->sfd);
+		free(p->q.buf);
+		free(p->tty);
+	}
+	free(ports);
+	if (!qflag) fprintf(stderr, "Connections closed.\n");
+	return ec;
+}
+
+
+/*
+ * Replay (--replay): write the data received in a capture to stdout or a
+ * pseudo terminal, with the original timing, scaled by rate, or as fast
+ * as possible (rate 0).  The capture is mapped and records are written
+ * straight from the mapping, gathered into as few writev(2) calls as the
+ * timing allows.
+ */
+#define REPLAYIOV	64
+
+static int
+writevall(int fd, struct iovec *iov, int n)
+{
+	ssize_t i;
+
+	while (n > 0) {
+		i = writev(fd, iov, n);
+		if (i < 0) {
+			if (errno == EINTR && scrunning)
+				continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)i >= iov->iov_len) {
+			i -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + i;
+			iov->iov_len -= i;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Create a pseudo terminal in raw mode for the replay and return the
+ * master side.  The slave stays open so that readers can come and go.
+ */
+static int
+replaypty(int *slave)
+{
+	struct termios ti;
+	char *name;
+	int fd;
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) ||
+			unlockpt(fd) || (name = ptsname(fd)) == NULL) {
+		warn("posix_openpt()");
+		return -1;
+	}
+	if ((*slave = open(name, O_RDWR | O_NOCTTY)) < 0) {
+		warn("open %s", name);
+		close(fd);
+		return -1;
+	}
+	if (tcgetattr(*slave, &ti) == 0) {
+		cfmakeraw(&ti);
+		tcsetattr(*slave, TCSANOW, &ti);
+	}
+	fprintf(stderr, "Replaying on %s\n", name);
+	return fd;
+}
+
+static int
+replay(const char *fn, double rate, int usepty)
+{
+	struct sccap_map m;
+	struct sccap_rec r;
+	struct iovec iov[REPLAYIOV];
+	struct timespec t0, due, end;
+	const unsigned char *data;
+	unsigned long long total = 0;
+	uint64_t first = 0, ns;
+	size_t off = SCCAP_HDRSIZE;
+	int fd = STDOUT_FILENO, slave = -1, niov = 0, ec = 0;
+
+	if (sccap_map(&m, fn) < 0) {
+		warn("%s", fn);
+		return EX_NOINPUT;
+	}
+	if (usepty && (fd = replaypty(&slave)) < 0) {
+		sccap_unmap(&m);
+		return EX_OSERR;
+	}
+	signal(SIGHUP, sighandler);
+	signal(SIGINT, sighandler);
+	signal(SIGQUIT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (scrunning && sccap_mapnext(&m, &off, &r, &data)) {
+		if (r.type != SCCAP_RX || r.len == 0)
+			continue;
+		if (total == 0)
+			first = r.time;
+		if (rate > 0 && r.time > first) {
+			ns = (r.time - first) / rate;
+			due.tv_sec = t0.tv_sec + ns / 1000000000;
+			due.tv_nsec = t0.tv_nsec + ns % 1000000000;
+			if (due.tv_nsec >= 1000000000) {
+				due.tv_sec++;
+				due.tv_nsec -= 1000000000;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if (end.tv_sec < due.tv_sec || (end.tv_sec == due.tv_sec &&
+					end.tv_nsec < due.tv_nsec)) {
+				if (niov > 0 && writevall(fd, iov, niov) < 0) {
+					ec = EX_IOERR;
+					break;
+				}
+				niov = 0;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&due, NULL) == EINTR && scrunning)
+					;
+			}
+		}
+		iov[niov].iov_base = (void *)data;
+		iov[niov].iov_len = r.len;
+		total += r.len;
+		if (++niov == REPLAYIOV) {
+			if (writevall(fd, iov, niov) < 0) {
+				ec = EX_IOERR;
+				break;
+			}
+			niov = 0;
+		}
+	}
+	if (ec == 0 && niov > 0 && scrunning && writevall(fd, iov, niov) < 0)
+		ec = EX_IOERR;
+	if (ec != 0 && scrunning)
+		warn("write");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (slave != -1) {
+		struct timespec d = { 0, 10 * 1000 * 1000 };
+
+		/* give the reader a chance to drain the pty before it hangs up */
+		while (scrunning && ioctl(slave, FIONREAD, &niov) == 0 && niov > 0)
+			nanosleep(&d, NULL);
+		close(slave);
+		close(fd);
+	}
+	if (!qflag) {
+		double secs = (end.tv_sec - t0.tv_sec) + (end.tv_nsec - t0.tv_nsec) / 1e9;
+
+		fprintf(stderr, "Replayed %llu bytes in %.3f seconds (%.1f MB/s)\n",
+				total, secs, secs > 0 ? total / secs / 1e6 : 0.0);
+	}
+	sccap_unmap(&m);
+	return ec;
+}
+
+/*
+ * Parse a size with an optional suffix k, M or G.  Returns -1 if it is
+ * not a number or out of range.
+ */
+static int
+parsesize(const char *s, size_t *size)
+{
+	char *ep;
+	double v = strtod(s, &ep);
+
+	switch (*ep) {
+		case 'k':
+		case 'K':
+			v *= 1024;
+			ep++;
+			break;
+		case 'm':
+		case 'M':
+			v *= 1024 * 1024;
+			ep++;
+			break;
+		case 'g':
+		case 'G':
+			v *= 1024 * 1024 * 1024;
+			ep++;
+			break;
+	}
+	if (ep == s || *ep != '\0' || v < 0 || v > SIZE_MAX / 2)
+		return -1;
+	*size = v;
+	return 0;
+}
+
+/**
+ * parse a key sequence.
+ * The string key_sequence is modified in place.
+ * The string key_sequence may only contain hex-digits and white space.
+ * It must have a length of at least 2 characters to parse a key.
+ * @param[in,out] key_sequence string of hex-digits on input; binary values on output.
+ * @return number of bytes parsed and converted in key_sequence.
+ */
+static int
+parse_key_sequence(char *key_sequence)
+{
+	int digits_read = 0;
+	unsigned char b = 0;
+	char *c;
+	int key_sequence_len = 0;
+
+	if (key_sequence == NULL) {
+		return 0;
+	}
+
+	for(c = key_sequence; *c; ++c) {
+		if (isspace(*c)) continue;
+		if (! isxdigit(*c)) {
+			fprintf(stderr, "invalid character in key sequence: %c (0x%02x)\n", *c, (int)*c);
+			return -1;
+		}
+		if (digits_read == 0) {
+			b = hex2dec(*c) << 4;
+		} else if (digits_read == 1) {
+			b |= hex2dec(*c);
+			key_sequence[key_sequence_len++] = b;
+			key_sequence[key_sequence_len] = 0;
+			b = 0;
+		}
+		++digits_read;
+		digits_read &= 1;
+	}
+
+	return key_sequence_len;
+}
+
+/**
+ * parse a key identifier into a key sequence.
+ * @param key_id a key identifier.
+ * @param[out] key_sequence will be set to an allocated array of bytes. The caller has to free the returned value.
+ * @param[out] key_sequence_len size of key_sequence in bytes.
+ * @return 0 if key_id is NULL;
+ *         0 if key_id is a valid identifier, key_sequence and key_sequence_len are set;
+ *        -1 if key_id is an invalid identifier;
+ *        -2 upon parameter error.
+ */
+static int
+parse_key_identifier(const char *key_id, char **key_sequence, int *key_sequence_len)
+{
+	struct key_s {
 		const char *id;
 		const char *seq;
 		const char *comment;
@@ -647,7 +5742,151 @@ parse_key_identifier(const char *key_id, char **key_sequence, int *key_sequence_
 	return -1;
 }
 
+/*
+ * Add an expect rule "response=pattern".  The response is a key
+ * identifier as for -K or hex digits as for -k; the pattern is taken
+ * literally and may contain '='.
+ */
+static int
+expectadd(const char *spec)
+{
+	const char *eq = strchr(spec, '=');
+	struct rule *rl;
+	char *resp;
+	int len;
+
+	if (eq == NULL || eq == spec || eq[1] == '\0') {
+		warnx("expect rule \"%s\" is not response=pattern", spec);
+		return -1;
+	}
+	if ((ac.nrules & (ac.nrules - 1)) == 0) {
+		rl = realloc(ac.rules, (ac.nrules ? 2 * ac.nrules : 16) * sizeof(*rl));
+		if (rl == NULL)
+			err(EX_OSERR, "realloc()");
+		ac.rules = rl;
+	}
+	rl = &ac.rules[ac.nrules];
+	if ((resp = strndup(spec, eq - spec)) == NULL)
+		err(EX_OSERR, "strndup()");
+	if (parse_key_identifier(resp, &rl->resp, &rl->resplen) < 0) {
+		len = parse_key_sequence(resp);
+		if (len <= 0) {
+			warnx("expect rule \"%s\": invalid response", spec);
+			free(resp);
+			return -1;
+		}
+		rl->resp = resp;
+		rl->resplen = len;
+	} else {
+		free(resp);
+	}
+	rl->patlen = strlen(eq + 1);
+	if ((rl->pattern = (unsigned char *)strdup(eq + 1)) == NULL)
+		err(EX_OSERR, "strdup()");
+	rl->pending = 0;
+	rl->hits = 0;
+	ac.nrules++;
+	return 0;
+}
+
+/*
+ * Read expect rules from a file, one per line.  Empty lines and lines
+ * starting with '#' are ignored.
+ */
+static int
+expectfile(const char *fn)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t n;
+	int ec = 0;
+
+	if ((f = fopen(fn, "r")) == NULL) {
+		warn("%s", fn);
+		return EX_NOINPUT;
+	}
+	while (ec == 0 && (n = getline(&line, &linesize, f)) != -1) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+		if (n == 0 || line[0] == '#')
+			continue;
+		if (expectadd(line) < 0)
+			ec = EX_DATAERR;
+	}
+	free(line);
+	fclose(f);
+	return ec;
+}
+
+#if defined(UNITTEST)
+static struct {
+	unsigned char buf[256];
+	size_t len;
+	int calls;
+	const void *first;	/* the first span the sink got */
+} xftest;
+
+static void
+xsinktest(const struct iovec *iov, int n, int fd)
+{
+	int i;
+
+	if (xftest.calls++ == 0)
+		xftest.first = iov[0].iov_base;
+	for (i = 0; i < n; i++) {
+		memcpy(xftest.buf + xftest.len, iov[i].iov_base, iov[i].iov_len);
+		xftest.len += iov[i].iov_len;
+	}
+}
+#endif
+
+#if defined(INPUTBENCH)
+/*
+ * Microbenchmark of console_input() (make inputbench): a 64 KB paste of
+ * configuration lines, forwarded to /dev/null, with the scanner and with
+ * every byte going through the switch as before it.
+ */
+static int
+inputbench(void)
+{
+	static struct console con;
+	static unsigned char paste[65536];
+	size_t len = 0, n;
+	double t0, t;
+	int i, fd;
+
+	for (i = 0; len + 80 < sizeof(paste); i++) {
+		len += snprintf((char *)paste + len, sizeof(paste) - len,
+				"set interfaces ge-0/0/%d unit 0 family inet "
+				"address 10.%d.%d.1/24\r", i % 48, i / 256 % 256, i % 256);
+	}
+	if ((fd = open("/dev/null", O_WRONLY)) < 0)
+		err(EX_OSERR, "/dev/null");
+	queue_init(&serq, 2 * txroom(sizeof(paste)));
+	con.sfd = fd;
+	con.escchr = '~';
+	for (perbyte = 1; perbyte >= 0; perbyte--) {
+		con.escapestate = ESCAPESTATE_WAITFORCR;
+		t0 = nsnow() / 1e9;
+		for (n = 0; (t = nsnow() / 1e9 - t0) < 1; n++)
+			console_input(&con, paste, len);
+		printf("%-12s %8.0f MB/s\n", perbyte ? "per byte" : "scanner",
+				n * len / t / 1e6);
+	}
+	close(fd);
+	free(serq.buf);
+	return 0;
+}
+#endif
 
+#if defined(UNITTEST)
+#if defined(NDEBUG)
+#error "the self-tests need assert(), build them without -DNDEBUG"
+#endif
+/*
+ * Self-tests (make check), built in with -DUNITTEST only.
+ */
 static void
 unittest()
 {
@@ -672,7 +5911,7 @@ unittest()
 		free(s);
 	}
 	{
-		char *key_sequence;
+		char *key_sequence = NULL;
 		int key_sequence_len;
 		assert(parse_key_identifier(NULL, &key_sequence, &key_sequence_len) == 0);
 		assert(parse_key_identifier("does not exist", &key_sequence, &key_sequence_len) < 0);
@@ -686,29 +5925,391 @@ unittest()
 		assert(key_sequence[2] == 0x53);
 		free(key_sequence);
 	}
+	{
+		static struct console con;
+		static const char in[] = "ab~~c\r~~d\r~x41\r~xg\r~q\n\r\r~.ef";
+		static const char out[] = "ab~~c\r~d\rA\r\r~q\n\r\r";
+		char buf[sizeof(out)];
+		int fds[2], r, w;
+		ssize_t n;
+
+		r = pipe(fds);
+		assert(r == 0);
+		queue_init(&serq, sizeof(out));
+		con.sfd = fds[1];
+		con.escchr = '~';
+		con.escapestate = ESCAPESTATE_WAITFORCR;
+		qflag++;
+		console_input(&con, (const unsigned char *)in, sizeof(in) - 1);
+		qflag--;
+		assert(!scrunning);
+		scrunning = 1;
+		n = read(fds[0], buf, sizeof(buf));
+		assert(n == sizeof(out) - 1);
+		assert(memcmp(buf, out, sizeof(out) - 1) == 0);
+		close(fds[0]);
+		close(fds[1]);
+
+		/* with a newline delay, nothing past the '\n' goes out at once */
+		r = pipe(fds);
+		assert(r == 0);
+		queue_put(&serq, "ab\ncd", 5);
+		pace.nldelay = 1000000000;
+		testnow = 1000000000000ULL;
+		r = txflush(fds[1]);
+		assert(r == 0 && queue_len(&serq) == 2);
+		w = txwait();
+		r = txflush(fds[1]);
+		assert(w == 1000 && r == 0 && queue_len(&serq) == 2);
+		n = read(fds[0], buf, sizeof(buf));
+		assert(n == 3);
+		testnow += 999999999;
+		w = txwait();
+		assert(w == 1);
+		testnow++;
+		w = txwait();
+		r = txflush(fds[1]);
+		assert(w == 0 && r == 0 && queue_len(&serq) == 0);
+		n = read(fds[0], buf, sizeof(buf));
+		assert(n == 2 && memcmp(buf, "cd", 2) == 0);
+		testnow = 0;
+		memset(&pace, 0, sizeof(pace));
+		serq.head = serq.tail;
+
+		/* a due key sequence is sent once and rescheduled on its grid */
+		keyscheds[0].seq = "K";
+		keyscheds[0].len = 1;
+		keyscheds[0].interval = 1000000000;
+		keyscheds[0].count = 2;
+		nkeyscheds = 1;
+		testnow = 1000000000000ULL;
+		keystart();
+		w = keywait();
+		r = keysend();
+		assert(w == 1000 && r == 0);
+		testnow += 3500000000ULL;
+		w = keywait();
+		r = keysend();
+		assert(w == 0 && r == 1 && queue_len(&serq) == 1);
+		w = keywait();
+		assert(w == 500 && keyscheds[0].next == testnow + 500000000);
+		testnow += 1000000000;
+		r = keysend();
+		w = keywait();
+		assert(r == 1 && keyscheds[0].len == 0 && w == -1);
+		keystop();
+		testnow = 0;
+		serq.head = serq.tail;
+
+		/* overlapping patterns, split between two reads */
+		r = expectadd("41=he");
+		r |= expectadd("42=she");
+		r |= expectadd("43=his");
+		r |= expectadd("44=hers");
+		r |= expectadd("45=he");
+		r |= expectbuild();
+		assert(r == 0);
+		qflag++;
+		r = expectscan((const unsigned char *)"ush", 3);
+		assert(r == 0);
+		r = expectscan((const unsigned char *)"ers", 3);
+		assert(r == 4);
+		r = expectscan((const unsigned char *)"hi", 2);
+		assert(r == 0);
+		qflag--;
+		assert(queue_len(&serq) == 4 && ac.rules[0].hits == 1 && ac.rules[2].hits == 0);
+
+		/* with serq full, the responses wait for room */
+		serq.head = serq.tail - serq.size;
+		ac.state = 0;
+		qflag++;
+		r = expectscan((const unsigned char *)"she", 3);
+		qflag--;
+		assert(r == 3 && ac.npending == 3 && ac.rules[0].hits == 1);
+		r = expectretry();
+		assert(r == 0);
+		serq.head = serq.tail;
+		qflag++;
+		r = expectretry();
+		qflag--;
+		assert(r == 3 && ac.npending == 0 && queue_len(&serq) == 3);
+		assert(ac.rules[0].hits == 2 && ac.rules[1].hits == 2);
+		serq.head = serq.tail;
+		expectfree();
+		close(fds[0]);
+		close(fds[1]);
+		free(serq.buf);
+
+		assert(scanspecial((const unsigned char *)in, (const unsigned char *)in + 10) == (const unsigned char *)in + 5);
+		assert(scanspecial((const unsigned char *)in, (const unsigned char *)in + 4) == (const unsigned char *)in + 4);
+	}
+	{
+		struct queue q;
+		char buf[16];
+		int fds[2], r;
+		ssize_t n;
+
+		queue_init(&q, 5);
+		assert(q.size == 8);
+		queue_put(&q, "abcdef", 6);
+		q.head += 4;
+		queue_put(&q, "ghijkl", 6);
+		assert(queue_len(&q) == 8 && q.dropped == 0);
+		queue_put(&q, "mn", 2);
+		assert(queue_len(&q) == 8 && q.dropped == 2);
+		r = pipe(fds);
+		assert(r == 0);
+		r = queue_flush(&q, fds[1]);
+		assert(r == 0 && queue_len(&q) == 0);
+		n = read(fds[0], buf, sizeof(buf));
+		assert(n == 8 && memcmp(buf, "ghijklmn", 8) == 0);
+		queue_put(&q, "0123456789", 10);
+		assert(queue_len(&q) == 8 && q.dropped == 4);
+		assert(queue_find(&q, '7', 8) == 5 && queue_find(&q, '7', 5) == -1);
+		r = queue_flushn(&q, fds[1], 3);
+		assert(r == 0 && queue_len(&q) == 5);
+		n = read(fds[0], buf, sizeof(buf));
+		assert(n == 3 && memcmp(buf, "234", 3) == 0);
+		q.head = q.tail;
+		r = queue_write(&q, fds[1], "xyz", 3);
+		assert(r == 0 && queue_len(&q) == 0);
+		n = read(fds[0], buf, sizeof(buf));
+		assert(n == 3);
+		close(fds[0]);
+		close(fds[1]);
+		free(q.buf);
+	}
+	{
+		struct spsc r;
+		struct iovec iov[2];
+		size_t n;
+
+		spsc_init(&r, 8);
+		n = spsc_put(&r, "abcdef", 6);
+		assert(n == 6);
+		spsc_consume(&r, 4);
+		n = spsc_put(&r, "ghijklmn", 8);
+		assert(n == 6 && r.dropped == 2);
+		n = spsc_peek(&r, iov);
+		assert(n == 8);
+		assert(iov[0].iov_len == 4 && memcmp(iov[0].iov_base, "efgh", 4) == 0);
+		assert(iov[1].iov_len == 4 && memcmp(iov[1].iov_base, "ijkl", 4) == 0);
+		spsc_consume(&r, 8);
+		n = spsc_peek(&r, iov);
+		assert(n == 0);
+		/* head and tail are at 12: the free space wraps */
+		n = spsc_room(&r, iov);
+		assert(n == 8);
+		assert(iov[0].iov_len == 4 && iov[0].iov_base == r.buf + 4);
+		assert(iov[1].iov_len == 4 && iov[1].iov_base == r.buf);
+		memcpy(iov[0].iov_base, "mnop", 4);
+		memcpy(iov[1].iov_base, "q", 1);
+		spsc_commit(&r, 5);
+		n = spsc_room(&r, iov);
+		assert(n == 3);
+		n = spsc_peek(&r, iov);
+		assert(n == 5);
+		assert(memcmp(iov[0].iov_base, "mnop", 4) == 0 && *(char *)iov[1].iov_base == 'q');
+		free(r.buf);
+	}
+	{
+		static struct hist h;
+		int i;
+
+		assert(hist_bucket(0) == 0 && hist_bucket(63) == 63);
+		assert(hist_bucket(64) == 64 + 32 && hist_bucket(127) == 64 + 63);
+		for (i = 1; i <= 1000; i++)
+			hist_add(&h, i * 1000);
+		assert(h.n == 1000 && h.max == 1000000);
+		assert(hist_quantile(&h, 0.5) >= 500000 && hist_quantile(&h, 0.5) < 520000);
+		assert(hist_quantile(&h, 1.0) == 1000000);
+	}
+#if !defined(TERMIOS_SPEED_IS_INT) && defined(__linux__)
+	{
+		speed_t sp;
+		long other;
+
+		sp = parsespeed("115200", &other);
+		assert(sp == B115200 && other == 0);
+		sp = parsespeed("1843200", &other);
+		assert(sp == B38400 && other == 1843200);
+	}
+#endif
+	{
+		struct histmark marks[4];
+		unsigned long long found;
+		char line[16];
+		size_t size;
+		int i, r, n = 0;
+
+		r = parsesize("64k", &size);
+		assert(r == 0 && size == 65536);
+		r = parsesize("1.5M", &size);
+		assert(r == 0 && size == 1572864);
+		assert(parsesize("1x", &size) < 0 && parsesize("", &size) < 0);
+
+		/* lines stay whole, the oldest chunk is recycled */
+		historyinit(2 * HISTCHUNK);
+		for (i = 0; i < 3 * HISTCHUNK / 13; i++) {
+			snprintf(line, sizeof(line), "line %06d\r\n", i);
+			historyadd((unsigned char *)line, 13);
+		}
+		assert(history.nchunks == 2 && history.dropped > 0);
+		assert(history.oldest->data[history.oldest->len - 1] == '\n');
+		assert(memcmp(history.newest->data, "line ", 5) == 0);
+		assert(history.kept + history.dropped == 3 * HISTCHUNK / 13 * 13);
+		history.pat = line;
+		history.patlen = 11;
+		found = historyfind(marks, 4);
+		assert(found == 1 && marks[0].c == history.newest);
+		history.pat = "line 000000";
+		found = historyfind(marks, 4);
+		assert(found == 0);
+		for (i -= history.kept / 13; i < 3 * HISTCHUNK / 13; i++)
+			n += i % 10 == 5;
+		r = regcomp(&history.re, "^line [0-9]*5\r$", REG_EXTENDED | REG_NEWLINE);
+		assert(r == 0);
+		history.isre = 1;
+		found = historyfind(marks, 4);
+		assert(found == n);
+		/* the last match is the last line ending in 5 */
+		i = 3 * HISTCHUNK / 13 - 1;
+		snprintf(line, sizeof(line), "line %06d\r\n", i - (i - 5) % 10);
+		i = (n - 1) % 4;
+		assert(memcmp(marks[i].c->data + marks[i].bol, line, 13) == 0);
+		regfree(&history.re);
+		historyfree();
+	}
+	{
+		static struct xchain c;
+		static const unsigned char in[] = "ab\rc\xc1\xc2" "d\r";
+		static const unsigned char esc1[] = "x\x1b[1;3";
+		static const unsigned char esc2[] = "1mred\x1b]0;t\x1b\\!\x1b(Bok\n";
+		int r;
+
+		/* in order, one writev() for the lot */
+		r = xfparse(&c, "crcrlf,7bit");
+		assert(r == 0 && c.grow == 2);
+		xfrun(&c, in, sizeof(in) - 1, xsinktest, -1);
+		assert(xftest.len == 10 && xftest.calls == 1 && xftest.first == in);
+		assert(memcmp(xftest.buf, "ab\r\ncABd\r\n", 10) == 0);
+		memset(&xftest, 0, sizeof(xftest));
+
+		/* escape sequences split between reads */
+		r = xfparse(&c, "ansi");
+		assert(r == 0);
+		xfrun(&c, esc1, sizeof(esc1) - 1, xsinktest, -1);
+		xfrun(&c, esc2, sizeof(esc2) - 1, xsinktest, -1);
+		assert(xftest.len == 8 && memcmp(xftest.buf, "xred!ok\n", 8) == 0);
+		memset(&xftest, 0, sizeof(xftest));
+
+		/* a time stamp as the first byte of each line goes through */
+		r = xfparse(&c, "ts,lfcr");
+		assert(r == 0 && c.grow == TSLEN + 1);
+		xfrun(&c, (const unsigned char *)"a\n", 2, xsinktest, -1);
+		xfrun(&c, (const unsigned char *)"b", 1, xsinktest, -1);
+		assert(xftest.len == 2 * TSLEN + 3);
+		assert(xftest.buf[4] == '-' && xftest.buf[TSLEN - 1] == ' ');
+		assert(memcmp(xftest.buf + TSLEN, "a\r", 2) == 0);
+		assert(xftest.buf[2 * TSLEN + 2] == 'b');
+		memset(&xftest, 0, sizeof(xftest));
+
+		/* a line per 16 bytes, the offset carrying on */
+		r = xfparse(&c, "hex");
+		assert(r == 0 && c.grow == HEXLINEMAX);
+		xfrun(&c, (const unsigned char *)"0123456789abcdefxyz\n", 20,
+				xsinktest, -1);
+		assert(xftest.len == 82 + 70);
+		assert(memcmp(xftest.buf, "< 00000000  30 31 32 33 34 35 36 37  "
+				"38 39 61 62 63 64 65 66  |0123456789abcdef|\r\n", 82) == 0);
+		assert(memcmp(xftest.buf + 82, "< 00000010  78 79 7a 0a ", 24) == 0);
+		assert(memcmp(xftest.buf + 82 + 62, "|xyz.|\r\n", 8) == 0);
+		memset(&xftest, 0, sizeof(xftest));
+	}
+	{
+		struct timespec ts = { 1700000000, 0 };
+		char want[64];
+		struct tm tm;
+		int i;
+
+		/* the digits updated in place match formatting in full */
+		tsinit();
+		for (i = 0; i < 150; i++) {
+			ts.tv_sec += i % 3 == 0;
+			ts.tv_nsec = (ts.tv_nsec + 337000000) % 1000000000;
+			tsformat(&ts);
+			localtime_r(&ts.tv_sec, &tm);
+			strftime(want, sizeof(want), "%Y-%m-%d %H:%M:%S", &tm);
+			snprintf(want + 19, sizeof(want) - 19, ".%03ld ",
+					ts.tv_nsec / 1000000);
+			assert(memcmp(tscache.prefix, want, TSLEN) == 0);
+		}
+	}
+	/* don't count the tests in the statistics */
+	memset(&st, 0, sizeof(st));
 }
+#endif
 
 static void
 usage(void)
 {
 	fprintf(stderr, "Connect to a serial device, using this system as a console. Version %s.\n"
-			"usage:\tsc [-fmq] [-d ms] [-e escape] [-p parms] [-s speed] [-k 'key sequence'] [-K <key>] device\n"
+			"usage:\tsc [-fmqz] [-d ms] [--char-delay ms] [--tx-rate bytes] [-e escape] [-l logfile] [-L secs] [-o policy] [-p parms] [-s speed] [-w capture]\n"
+			"\t   [-k 'key sequence' | -K <key> [--interval secs] [--count n] [--duration secs]] ...\n"
+			"\t   [--expect response=pattern] ... [--expect-file file] [--history size] [--backend poll|io_uring] [--threads[=cpu]] [--low-latency[=prio]] [--render rate] [--control path]\n"
+			"\t   [--imap list] [--omap list] [--logmap list] [--listen [host]:port | --daemon session [--scrollback size]] device\n"
+			"\tsc attach [-q] [-e escape] [--scrollback size] [--history size] session\n"
+			"\tsc --replay capture [--rate factor|max] [--pty] [-q]\n"
+			"\tsc -M [-fmq] [-c file] [-o policy] [-p parms] [-s speed] device[,speed[,parms]]=sink ...\n"
+			"\t-c: read port specifications for -M from file, one per line\n"
 			"\t-f: use hardware flow control (CRTSCTS)\n"
+			"\t-l: append everything received from the device to logfile\n"
+			"\t-L: fsync() the log and capture every secs seconds\n"
 			"\t-m: use modem lines (!CLOCAL)\n"
+			"\t-M: relay many devices, each to a file, unix:path or tcp:host:port sink\n"
 			"\t-q: don't show connect, disconnect and escape action messages\n"
+			"\t-z: relay serial output to a non-tty stdout with splice() (Linux)\n"
  			"\t-d: delay in milliseconds after each newline character\n"
+			"\t--char-delay: delay in milliseconds between characters sent\n"
+			"\t--tx-rate: send at most this many bytes per second\n"
 			"\t-e: escape char or \"none\", default '~'\n"
+			"\t-o: when stdout falls behind: \"block\" reading the device (default),\n"
+			"\t    \"drop\" the oldest output, or deassert \"rts\"\n"
 			"\t-p: bits per char, parity, stop bits, default \"%s\"\n"
 			"\t-s: speed, default \"%s\"\n"
+			"\t-w: record data in both directions with timestamps, see scdump(1)\n"
+			"\t--replay: write the data received in a capture with its original timing\n"
+			"\t--rate: replay factor times as fast, or as fast as possible\n"
+			"\t--pty: replay to a new pseudo terminal instead of stdout\n"
 		        "\t-k: send key(s) once per second. 'key sequence' contains hex digits and white space.\n"
 			"\t-K: send a single key once per second. Use 'list' to show valid key identifiers.\n"
+			"\t--interval: send the preceding -k or -K every secs seconds instead\n"
+			"\t--count: send the preceding -k or -K only n times\n"
+			"\t--duration: stop sending the preceding -k or -K after secs seconds\n"
+			"\t--expect: when pattern is received, send response (a -K key or -k hex)\n"
+			"\t--expect-file: read response=pattern rules from file, one per line\n"
+			"\t--listen: serve the device to TCP clients instead of the terminal\n"
+			"\t--daemon: run in the background as session, to attach to with \"sc attach\"\n"
+			"\t--scrollback: output kept by the session (default 1M) or shown on attach\n"
+			"\t--history: output kept in memory for searching (default 64M)\n"
+			"\t--backend: wait for the devices with \"io_uring\" (default on Linux) or \"poll\"\n"
+			"\t--threads: read the device and write stdout in threads, the reader pinned to cpu\n"
+			"\t--low-latency: no receive batching by the driver; run at SCHED_FIFO prio, memory locked\n"
+			"\t--render: write to the terminal in frames, at most rate bytes/s, skipping the excess\n"
+			"\t--control: take commands (break, send, speed, parms, dtr, stats) on a UNIX socket\n"
+			"\t--imap, --omap, --logmap: transform output, input or the log with a list of\n"
+			"\t    crlf, crcrlf, igncr, lfcr, lfcrlf, ignlf, ansi, 7bit, ts, hex\n"
 			"\tdevice, default \"%s\"\n",
 			SC_VERSION, DEFAULTPARMS, DEFAULTSPEED, DEFAULTDEVICE);
 	fprintf(stderr, "escape actions are started with the 3 character combination: CR + ~ +\n"
 		        "\t~ - send '~' character\n"
 		        "\t. - disconnect\n"
 		        "\tb - send break\n"
-		        "\tk - stop sending the key (sequence)\n"
+		        "\th - toggle the hexdump view\n"
+		        "\tk - stop sending the key sequences\n"
+		        "\ts - show statistics (also on SIGUSR1)\n"
+		        "\t/ - search the scrollback for a string\n"
+		        "\tr - search the scrollback for a regular expression\n"
    		        "\tx<2 hex digits> - send decoded character\n");
 #if defined(TERMIOS_SPEED_IS_INT)
 	fprintf(stderr, "available speeds depend on device\n");
@@ -737,20 +6338,95 @@ main(int argc, char **argv)
 	char *parms = DEFAULTPARMS;
 	int fflag = 0;
 	int mflag = 0;
+	int Mflag = 0;
+	char *portfile = NULL;
+	char *logfile = NULL;
+	char *capfile = NULL;
 	int sfd = -1;
 	char buffer[PATH_MAX+1];
 	struct termios serialti, consoleti, tempti;
 	int ec = 0;
 	int msdelay = 0;
+	double chardelay = 0, txrate = 0;
 	int i;
-	char c;
+	int c;
 	char *key_sequence = NULL;
 	int key_sequence_len = 0;
+	struct keysched *k = NULL;
+	char *replayfile = NULL;
+	double replayrate = 1;
+	int ptyflag = 0;
+	char *listenaddr = NULL;
+	char *sessionname = NULL;
+	char *ctlpath = NULL;
+	size_t scrollback = 0;
+	size_t historysize = HISTORYSIZE;
+	int headless, lfd = -1;
+	int optindex = 0;
+	static struct option longopts[] = {
+		{ "replay",	required_argument,	NULL,	OPT_REPLAY },
+		{ "rate",	required_argument,	NULL,	OPT_RATE },
+		{ "pty",	no_argument,		NULL,	OPT_PTY },
+		{ "char-delay",	required_argument,	NULL,	OPT_CHARDELAY },
+		{ "tx-rate",	required_argument,	NULL,	OPT_TXRATE },
+		{ "interval",	required_argument,	NULL,	OPT_INTERVAL },
+		{ "count",	required_argument,	NULL,	OPT_COUNT },
+		{ "duration",	required_argument,	NULL,	OPT_DURATION },
+		{ "expect",	required_argument,	NULL,	OPT_EXPECT },
+		{ "expect-file",	required_argument,	NULL,	OPT_EXPECTFILE },
+		{ "listen",	required_argument,	NULL,	OPT_LISTEN },
+		{ "daemon",	required_argument,	NULL,	OPT_DAEMON },
+		{ "scrollback",	required_argument,	NULL,	OPT_SCROLLBACK },
+		{ "history",	required_argument,	NULL,	OPT_HISTORY },
+		{ "backend",	required_argument,	NULL,	OPT_BACKEND },
+		{ "threads",	optional_argument,	NULL,	OPT_THREADS },
+		{ "low-latency", optional_argument,	NULL,	OPT_LOWLATENCY },
+		{ "render",	required_argument,	NULL,	OPT_RENDER },
+		{ "control",	required_argument,	NULL,	OPT_CONTROL },
+		{ "imap",	required_argument,	NULL,	OPT_IMAP },
+		{ "omap",	required_argument,	NULL,	OPT_OMAP },
+		{ "logmap",	required_argument,	NULL,	OPT_LOGMAP },
+		{ NULL,		0,			NULL,	0 }
+	};
 
+#if defined(UNITTEST)
 	unittest();
+	return 0;
+#elif defined(INPUTBENCH)
+	return inputbench();
+#endif
 
-	while ((c = getopt(argc, argv, "d:e:fhk:K:mp:qs:?")) != -1) {
+	while ((c = getopt_long(argc, argv, "c:d:e:fhk:K:l:L:mMo:p:qs:w:z?",
+			longopts, &optindex)) != -1) {
 		switch (c) {
+			case OPT_REPLAY:
+				replayfile = optarg;
+				break;
+			case OPT_RATE:
+				if (strcmp(optarg, "max") == 0) {
+					replayrate = 0;
+				} else {
+					char *ep;
+
+					replayrate = strtod(optarg, &ep);
+					if (ep == optarg || *ep != '\0' || replayrate <= 0)
+						errx(EX_USAGE, "Invalid replay rate \"%s\"", optarg);
+				}
+				break;
+			case OPT_PTY:
+				ptyflag = 1;
+				break;
+			case OPT_CHARDELAY:
+			case OPT_TXRATE: {
+				double *v = c == OPT_CHARDELAY ? &chardelay : &txrate;
+				char *ep;
+
+				*v = strtod(optarg, &ep);
+				if (ep == optarg || *ep != '\0' || *v <= 0)
+					errx(EX_USAGE, "Invalid %s \"%s\"",
+							c == OPT_CHARDELAY ? "character delay" : "transmit rate", optarg);
+				break;
+			}
 			case 'd':
 				msdelay=atoi(optarg);
 				if(msdelay <= 0)
@@ -768,32 +6444,174 @@ main(int argc, char **argv)
 					errx(EX_USAGE, "Invalid escape character \"%s\"", optarg);
 				}
 				break;
+			case 'c':
+				portfile = optarg;
+				Mflag = 1;
+				break;
 			case 'f':
 				fflag = 1;
 				break;
+			case 'l':
+				logfile = optarg;
+				break;
+			case 'L':
+				logsync = atoi(optarg);
+				if (logsync < 0)
+					errx(EX_USAGE, "Invalid fsync interval \"%s\"", optarg);
+				break;
 			case 'm':
 				mflag = 1;
 				break;
+			case 'M':
+				Mflag = 1;
+				break;
+			case 'o':
+				if (strcmp(optarg, "block") == 0) {
+					qpolicy = QPOLICY_BLOCK;
+				} else if (strcmp(optarg, "drop") == 0) {
+					qpolicy = QPOLICY_DROP;
+				} else if (strcmp(optarg, "rts") == 0) {
+					qpolicy = QPOLICY_RTS;
+				} else {
+					errx(EX_USAGE, "Invalid output policy \"%s\"", optarg);
+				}
+				break;
 			case 'p':
 				parms = optarg;
 				break;
 			case 'q':
 				qflag = 1;
+				break;
 			case 's':
 				speed = optarg;
 				break;
-			case 'k':
-				key_sequence = optarg;
-				key_sequence_len = parse_key_sequence(key_sequence);
-				if (key_sequence_len < 0) {
-					errx(EX_USAGE, "invalid key in key_sequence");
-				}
+			case 'w':
+				capfile = optarg;
+				break;
+			case 'z':
+				zflag = 1;
 				break;
+			case 'k':
 			case 'K':
-				if (parse_key_identifier(optarg, &key_sequence, &key_sequence_len) < 0) {
+				if (c == 'k') {
+					key_sequence = optarg;
+					key_sequence_len = parse_key_sequence(key_sequence);
+					if (key_sequence_len < 0) {
+						errx(EX_USAGE, "invalid key in key_sequence");
+					}
+				} else if (parse_key_identifier(optarg, &key_sequence, &key_sequence_len) < 0) {
 					return EX_USAGE;
 				}
+				if (nkeyscheds == MAXKEYSCHEDS)
+					errx(EX_USAGE, "Too many key sequences, at most %d", MAXKEYSCHEDS);
+				k = &keyscheds[nkeyscheds++];
+				k->seq = key_sequence;
+				k->len = key_sequence_len;
+				k->interval = 1000000000;
+				break;
+			case OPT_LISTEN:
+				listenaddr = optarg;
+				break;
+			case OPT_DAEMON:
+				sessionname = optarg;
+				break;
+			case OPT_SCROLLBACK:
+				if (parsesize(optarg, &scrollback) < 0 || scrollback < 1)
+					errx(EX_USAGE, "Invalid scrollback size \"%s\"", optarg);
+				break;
+			case OPT_HISTORY:
+				if (parsesize(optarg, &historysize) < 0)
+					errx(EX_USAGE, "Invalid history size \"%s\"", optarg);
+				break;
+			case OPT_BACKEND:
+				if (strcmp(optarg, "poll") == 0) {
+					useuring = 0;
+				} else if (strcmp(optarg, "io_uring") == 0) {
+#if !defined(HAS_IO_URING)
+					warnx("io_uring is not available, using poll()");
+#endif
+					useuring = 1;
+				} else {
+					errx(EX_USAGE, "Invalid backend \"%s\"", optarg);
+				}
+				break;
+			case OPT_THREADS:
+#if defined(HAS_BROKEN_POLL)
+				warnx("threads are not supported on this system");
+#endif
+				thr.enabled = 1;
+				if (optarg != NULL) {
+					char *ep;
+					long l = strtol(optarg, &ep, 10);
+
+					if (*optarg == '\0' || *ep != '\0' || l < 0 || l > 1023)
+						errx(EX_USAGE, "Invalid CPU \"%s\"", optarg);
+#if !defined(__linux__)
+					warnx("pinning threads is not supported on this system");
+#endif
+					thr.cpu = l;
+				}
+				break;
+			case OPT_CONTROL:
+				ctlpath = optarg;
+				break;
+			case OPT_IMAP:
+				if (xfparse(&imap, optarg) < 0)
+					exit(EX_USAGE);
+				break;
+			case OPT_OMAP:
+				if (xfparse(&omap, optarg) < 0)
+					exit(EX_USAGE);
+				break;
+			case OPT_LOGMAP:
+				if (xfparse(&logmap, optarg) < 0)
+					exit(EX_USAGE);
+				break;
+			case OPT_RENDER:
+				if (parsesize(optarg, &render.rate) < 0 || render.rate < 1)
+					errx(EX_USAGE, "Invalid render rate \"%s\"", optarg);
+				break;
+			case OPT_LOWLATENCY:
+				lowlat = 0;
+				if (optarg != NULL) {
+					char *ep;
+					long l = strtol(optarg, &ep, 10);
+
+					if (*optarg == '\0' || *ep != '\0' || l < 1 || l > 99)
+						errx(EX_USAGE, "Invalid priority \"%s\"", optarg);
+					lowlat = l;
+				}
+				break;
+			case OPT_EXPECT:
+				if (expectadd(optarg) < 0)
+					return EX_USAGE;
+				break;
+			case OPT_EXPECTFILE:
+				if ((ec = expectfile(optarg)) != 0)
+					return ec;
 				break;
+			case OPT_INTERVAL:
+			case OPT_COUNT:
+			case OPT_DURATION: {
+				char *ep;
+				double v = strtod(optarg, &ep);
+
+				if (k == NULL)
+					errx(EX_USAGE, "--%s applies to the -k or -K before it",
+							longopts[optindex].name);
+				if (ep == optarg || *ep != '\0' || v <= 0 ||
+						(c == OPT_COUNT && v != (unsigned long)v))
+					errx(EX_USAGE, "Invalid %s \"%s\"", longopts[optindex].name, optarg);
+				if (c == OPT_INTERVAL && v < 0.001)
+					errx(EX_USAGE, "Interval \"%s\" is shorter than a millisecond", optarg);
+				if (c == OPT_INTERVAL)
+					k->interval = v * 1e9;
+				else if (c == OPT_COUNT)
+					k->count = v;
+				else
+					k->duration = v * 1e9;
+				break;
+			}
 			case 'h':
 			case '?':
 			default:
@@ -802,15 +6620,50 @@ main(int argc, char **argv)
 	}
 	argc -= optind;
 	argv += optind;
+	if (replayfile != NULL) {
+		if (argc > 0)
+			usage();
+		return replay(replayfile, replayrate, ptyflag);
+	}
+	if (Mflag) {
+		raisenofile();
+		if (portfile != NULL)
+			ec = addportfile(portfile, speed, parms, fflag, mflag);
+		for (i = 0; ec == 0 && i < argc; i++)
+			ec = addport(argv[i], speed, parms, fflag, mflag);
+		if (ec == 0 && nports == 0)
+			usage();
+		return multiport(ec);
+	}
+	historyinit(historysize);
+	if (argc == 2 && strcmp(argv[0], "attach") == 0)
+		return attach(argv[1], escchr, scrollback);
 	if (argc == 1) {
 		tty = argv[0];
 	}
 	if (argc > 1) {
 		usage();
 	}
+	headless = listenaddr != NULL || sessionname != NULL;
+	if (headless)
+		historyinit(0);
 
-	if (key_sequence_len > 0) {
-		fprintf(stderr, "will send %i bytes/keys every second\n", key_sequence_len);
+	if (ac.nrules > 0) {
+		if (expectbuild() < 0)
+			return EX_OSERR;
+		if (!qflag)
+			fprintf(stderr, "will answer %d expect rules\n", ac.nrules);
+	}
+	for (i = 0; i < nkeyscheds; i++) {
+		k = &keyscheds[i];
+		if (k->len == 0)
+			continue;
+		fprintf(stderr, "will send %i bytes/keys every %g seconds", k->len, k->interval / 1e9);
+		if (k->count > 0)
+			fprintf(stderr, ", %lu times", k->count);
+		if (k->duration > 0)
+			fprintf(stderr, ", for %g seconds", k->duration / 1e9);
+		fprintf(stderr, "\n");
 	}
 
 	if (strchr(tty, '/') == NULL) {
@@ -826,7 +6679,7 @@ main(int argc, char **argv)
 		err(EX_OSERR, "open %s", tty);
 	}
 	/* save tty configuration */
-	if (tcgetattr(STDIN_FILENO, &consoleti)) {
+	if (!headless && tcgetattr(STDIN_FILENO, &consoleti)) {
 		close(sfd);
 		err(EX_OSERR, "tcgetattr() tty");
 	}
@@ -837,27 +6690,13 @@ main(int argc, char **argv)
 	}
 	/* configure serial port */
 	memcpy(&tempti, &serialti, sizeof(tempti));
-	cfmakeraw(&tempti);
-	tempti.c_cc[VMIN] = 1;
-	tempti.c_cc[VTIME] = 0;
-	if (cfsetspeed(&tempti, parsespeed(speed))) {
-		ec = EX_OSERR;
-		warn("cfsetspeed(%s)", tty);
-		goto error;
-	}
-	if (parseparms(&tempti.c_cflag, parms, fflag, mflag)) {
-		ec = EX_USAGE;
-		goto error;
-	}
-	if (tcsetattr(sfd, TCSANOW, &tempti)) {
-		ec = EX_OSERR;
-		warn("tcsetattr(%s)", tty);
+	if ((ec = serialsetup(sfd, tty, &tempti, speed, parms, fflag, mflag)) != 0)
 		goto error;
-	}
 	signal(SIGHUP, sighandler);
 	signal(SIGINT, sighandler);
 	signal(SIGQUIT, sighandler);
 	signal(SIGTERM, sighandler);
+	signal(SIGUSR1, siginfohandler);
 
 	if (!qflag) {
 		/* re-read serial port configuration */
@@ -865,9 +6704,52 @@ main(int argc, char **argv)
 			close(sfd);
 			err(EX_OSERR, "tcgetattr(%s)", tty);
 		}
-		printparms(&tempti, tty);
+		printparms(&tempti, sfd, tty, speed);
 		fflush(stderr);
 	}
+	if (msdelay > 0)
+		pace.nldelay = msdelay * 1000000ULL;
+	pace.chardelay = chardelay * 1e6;
+	if (txrate > 0)
+		pace.bytecost = 1e9 / txrate;
+	if (ctlpath != NULL) {
+		if (ctlopen(ctlpath) < 0) {
+			ec = EX_UNAVAILABLE;
+			goto error;
+		}
+		if (!qflag)
+			fprintf(stderr, "Control socket %s\n", ctl.path);
+	}
+	if (sessionname != NULL) {
+		/* the writer threads of -l and -w must be started after this */
+		if ((lfd = sessionopen(sessionname, scrollback)) < 0) {
+			ec = EX_UNAVAILABLE;
+			goto error;
+		}
+	} else if (listenaddr != NULL) {
+		if ((lfd = listensock(listenaddr)) < 0) {
+			ec = EX_UNAVAILABLE;
+			goto error;
+		}
+		if (!qflag)
+			fprintf(stderr, "Listening on %s\n", listenaddr);
+	}
+	if ((logfile != NULL && logopen(&sesslog, logfile, O_APPEND) < 0) ||
+			(capfile != NULL && capopen(capfile) < 0)) {
+		ec = EX_CANTCREAT;
+		goto error;
+	}
+	/* after starting the writer threads, which need no realtime priority */
+	if (lowlat >= 0)
+		lowlatencyon(sfd, tty);
+	if (headless) {
+		modemcontrol(sfd, 1);
+		ec = serve(sfd, lfd);
+		if (sessionname != NULL)
+			sessionclose(sessionname);
+		goto error;
+	}
+
 	/* put tty into raw mode */
 	i = fcntl(STDIN_FILENO, F_GETFL);
 	if (i == -1 || fcntl(STDIN_FILENO, F_SETFL, i | O_NONBLOCK)) {
@@ -883,15 +6765,22 @@ main(int argc, char **argv)
 	}
 	modemcontrol(sfd, 1);
 
-	ec = loop(sfd, escchr, msdelay, key_sequence, key_sequence_len);
+	ec = loop(sfd, escchr);
 
 error:
 	if (sfd >= 0) {
+		lowlatencyoff(sfd);
 		modemcontrol(sfd, 0);
+		/* what loop() or serve() gave up on would hold up tcsetattr() */
+		tcflush(sfd, TCOFLUSH);
 		tcsetattr(sfd, TCSAFLUSH, &serialti);
-		tcsetattr(STDIN_FILENO, TCSAFLUSH, &consoleti);
+		if (!headless)
+			tcsetattr(STDIN_FILENO, TCSAFLUSH, &consoleti);
 		close(sfd);
 	}
+	ctlclose();
+	logclose(&sesslog);
+	capclose();
 	fprintf(stderr, "\n");
 	if (!qflag) fprintf(stderr, "Connection closed.\n");
 	return ec;
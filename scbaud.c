@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2006,2007 Stefan Bethke <stb@lassitu.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+
+#include "scbaud.h"
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#endif
+
+#if defined(__linux__) && defined(BOTHER) && defined(TCGETS2)
+int
+scbaud_set(int fd, long rate)
+{
+	struct termios2 t;
+
+	if (rate <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ioctl(fd, TCGETS2, &t) < 0)
+		return -1;
+	t.c_cflag &= ~CBAUD;
+	t.c_cflag |= BOTHER;
+	t.c_ospeed = rate;
+#if defined(IBSHIFT)
+	/* input speed follows the output speed */
+	t.c_cflag &= ~(CBAUD << IBSHIFT);
+#endif
+	t.c_ispeed = rate;
+	return ioctl(fd, TCSETS2, &t);
+}
+
+long
+scbaud_get(int fd)
+{
+	struct termios2 t;
+
+	if (ioctl(fd, TCGETS2, &t) < 0)
+		return -1;
+	return t.c_ospeed;
+}
+#else
+int
+scbaud_set(int fd, long rate)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+long
+scbaud_get(int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
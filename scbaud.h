@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2006,2007 Stefan Bethke <stb@lassitu.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Serial speeds termios has no code for.  On Linux, termios2 with BOTHER
+ * takes any rate in bits per second; the kernel headers it needs clash
+ * with <termios.h>, so it lives in a file of its own.  Elsewhere these
+ * fail with ENOTSUP.
+ */
+
+/* set both directions to rate, keeping all other settings */
+int	scbaud_set(int, long);
+/* the rate the driver reports it is using, or -1 */
+long	scbaud_get(int);
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2006,2007 Stefan Bethke <stb@lassitu.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Relay benchmark for sc.  A pseudo terminal stands in for the serial
+ * device and another one for the user's terminal, so no hardware is
+ * needed.  Reports throughput in both directions, read(2)/write(2) calls
+ * per KB and CPU time used by sc (from /proc on Linux), and the latency of
+ * single keystrokes from the terminal to the serial device.  With -c, the
+ * data is all byte values, written in blocks of varying size, and what
+ * comes out on the other side has to be exactly what went in.  With -t,
+ * sc keeps its escape character and scbench types escapes and newlines
+ * at it, checks what reaches the serial side and, with -d, the delay
+ * after each newline.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static double rate;		/* bytes per second to send, 0 for no limit */
+static int check;		/* compare what is relayed with what was sent */
+static int typing;		/* check the escapes and the newline delay */
+static int delay;		/* sc -d, in ms */
+
+struct procstat {
+	unsigned long long syscalls;	/* read(2) and write(2) family */
+	double cpu;			/* user + system seconds */
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+readproc(pid_t pid, struct procstat *ps)
+{
+	char fn[64], line[1024], *p;
+	unsigned long long v, ut, st;
+	FILE *f;
+
+	ps->syscalls = 0;
+	ps->cpu = 0;
+	snprintf(fn, sizeof(fn), "/proc/%d/io", (int)pid);
+	if ((f = fopen(fn, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "syscr: %llu", &v) == 1 ||
+				sscanf(line, "syscw: %llu", &v) == 1)
+			ps->syscalls += v;
+	}
+	fclose(f);
+	snprintf(fn, sizeof(fn), "/proc/%d/stat", (int)pid);
+	if ((f = fopen(fn, "r")) == NULL)
+		return -1;
+	p = fgets(line, sizeof(line), f);
+	fclose(f);
+	/* utime and stime are fields 14 and 15, the name in field 2 may contain blanks */
+	if (p == NULL || (p = strrchr(line, ')')) == NULL ||
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+				&ut, &st) != 2)
+		return -1;
+	ps->cpu = (double)(ut + st) / sysconf(_SC_CLK_TCK);
+	return 0;
+}
+
+static int
+openpty_raw(int *slave, char *name, size_t namelen)
+{
+	struct termios ti;
+	char *n;
+	int fd;
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) ||
+			unlockpt(fd) || (n = ptsname(fd)) == NULL)
+		err(EX_OSERR, "posix_openpt()");
+	snprintf(name, namelen, "%s", n);
+	if ((*slave = open(name, O_RDWR | O_NOCTTY)) < 0)
+		err(EX_OSERR, "open %s", name);
+	if (tcgetattr(*slave, &ti) == 0) {
+		cfmakeraw(&ti);
+		tcsetattr(*slave, TCSANOW, &ti);
+	}
+	return fd;
+}
+
+/*
+ * Write total bytes to wfd, at rate bytes per second if set, while reading
+ * back from rfd what sc relays, which may be more if it adds to the data,
+ * and report what it cost sc.
+ */
+static int
+pump(const char *what, int wfd, int rfd, size_t total, pid_t pid)
+{
+	static unsigned char out[65536], in[65536];
+	struct procstat ps0, ps1;
+	struct pollfd pfd[2];
+	size_t sent = 0, received = 0, allow, i, off;
+	uint32_t x = 1;
+	double t0, t1;
+	ssize_t n;
+	int haveproc, r;
+
+	for (i = 0; i < sizeof(out); i++) {
+		x = x * 1103515245 + 12345;
+		out[i] = check ? x >> 16 :
+			"0123456789abcdefghijklmnopqrstuvwxyz\n"[i % 37];
+	}
+	haveproc = readproc(pid, &ps0) == 0;
+	t0 = now();
+	while (sent < total || received < total) {
+		allow = total - sent;
+		/* at a rate, in slices of 1 ms as a UART with a FIFO would */
+		if (rate > 0 && (now() - t0) * rate < sent + allow) {
+			allow = (now() - t0) * rate > sent ? (now() - t0) * rate - sent : 0;
+			if (allow < rate / 1000)
+				allow = 0;
+		}
+		pfd[0].fd = allow > 0 ? wfd : -1;
+		pfd[0].events = POLLOUT;
+		pfd[1].fd = rfd;
+		pfd[1].events = POLLIN;
+		r = poll(pfd, 2, allow == 0 && sent < total ? 1 : 5000);
+		if (r < 0 || (r == 0 && (allow > 0 || sent == total))) {
+			warnx("%s: stalled after %zu of %zu bytes", what, received, total);
+			return -1;
+		}
+		if (pfd[0].revents & POLLOUT) {
+			/* the data carries on from where the last write ended */
+			off = check ? sent % sizeof(out) : 0;
+			n = allow < sizeof(out) - off ? allow : sizeof(out) - off;
+			if (check) {
+				x = x * 1103515245 + 12345;
+				n = 1 + (x >> 16) % n;
+			}
+			n = write(wfd, out + off, n);
+			if (n > 0)
+				sent += n;
+		}
+		if (pfd[1].revents & POLLIN) {
+			n = read(rfd, in, sizeof(in));
+			for (i = 0; check && n > 0 && i < (size_t)n; i++) {
+				if (received + i >= total ||
+						in[i] != out[(received + i) % sizeof(out)]) {
+					warnx("%s: byte %zu differs", what, received + i);
+					return -1;
+				}
+			}
+			if (n > 0)
+				received += n;
+		}
+	}
+	t1 = now();
+	if (haveproc)
+		haveproc = readproc(pid, &ps1) == 0;
+	if (check) {
+		printf("%-20s %zu bytes identical\n", what, total);
+		return 0;
+	}
+	printf("%-20s %9.2f MB/s", what, total / (t1 - t0) / 1e6);
+	if (haveproc)
+		printf("  %6.3f syscalls/KB  %6.2f ms CPU/MB",
+			(ps1.syscalls - ps0.syscalls) / (total / 1024.0),
+			(ps1.cpu - ps0.cpu) * 1e3 / (total / 1e6));
+	if (haveproc && rate > 0)
+		printf("  %5.2f%% CPU", (ps1.cpu - ps0.cpu) * 100 / (t1 - t0));
+	printf("\n");
+	return 0;
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Send single keystrokes and time how long each takes to show up on the
+ * serial side.
+ */
+static int
+latency(int cfd, int sfd, int samples)
+{
+	struct timespec gap = { 0, 200 * 1000 };
+	struct pollfd pfd;
+	unsigned char c;
+	double *lat, t0;
+	int i;
+
+	if ((lat = calloc(samples, sizeof(*lat))) == NULL)
+		err(EX_OSERR, "calloc()");
+	for (i = 0; i < samples; i++) {
+		c = 'a' + i % 26;
+		t0 = now();
+		if (write(cfd, &c, 1) != 1)
+			err(EX_IOERR, "write");
+		pfd.fd = sfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0 || read(sfd, &c, 1) != 1) {
+			warnx("keystroke %d lost", i);
+			free(lat);
+			return -1;
+		}
+		lat[i] = (now() - t0) * 1e6;
+		nanosleep(&gap, NULL);
+	}
+	qsort(lat, samples, sizeof(*lat), cmpdouble);
+	printf("%-20s p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n",
+		"keystroke latency", lat[samples / 2], lat[samples * 9 / 10],
+		lat[samples * 99 / 100], lat[samples - 1]);
+	free(lat);
+	return 0;
+}
+
+/*
+ * Type lines with escapes at sc and compare what arrives on the serial
+ * side with what should.  Nothing after the nth newline may arrive before
+ * n times the newline delay has passed since the script was written.
+ */
+static int
+typed(int cfd, int sfd)
+{
+	static const char script[] = "ab\r~~c\r~x41\rd\ne~f\r~~~x\n\ng\n";
+	static const char want[] = "ab\r~c\rA\rd\ne~f\r~~x\n\ng\n";
+	char got[sizeof(want)];
+	size_t received = 0, i;
+	double t0, t, gap = -1;
+	struct pollfd pfd;
+	int lines = 0;
+	ssize_t n;
+
+	t0 = now();
+	if (write(cfd, script, sizeof(script) - 1) != sizeof(script) - 1)
+		err(EX_IOERR, "write");
+	while (received < sizeof(want) - 1) {
+		pfd.fd = sfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 5000) <= 0 ||
+				(n = read(sfd, got + received, sizeof(want) - 1 - received)) <= 0) {
+			warnx("typing: stalled after %zu of %zu bytes", received,
+					sizeof(want) - 1);
+			return -1;
+		}
+		t = (now() - t0) * 1e3;
+		for (i = received; i < received + n; i++) {
+			if (got[i] != want[i]) {
+				warnx("typing: byte %zu is 0x%02x, not 0x%02x", i,
+						(unsigned char)got[i], (unsigned char)want[i]);
+				return -1;
+			}
+			if (i > 0 && want[i - 1] == '\n') {
+				lines++;
+				if (t < lines * delay) {
+					warnx("typing: line %d after %.1f ms, not %d",
+							lines + 1, t, lines * delay);
+					return -1;
+				}
+				if (gap < 0 || t / lines < gap)
+					gap = t / lines;
+			}
+		}
+		received += n;
+	}
+	printf("%-20s %zu bytes as expected", "escapes", sizeof(want) - 1);
+	if (delay > 0)
+		printf(", %.1f ms per line for -d %d", gap, delay);
+	printf("\n");
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Benchmark sc against pseudo terminals.\n"
+			"usage:\tscbench [-c] [-m megabytes] [-n keystrokes] [-r rate] sc [sc options]\n"
+			"\tscbench -t [-d ms] sc [sc options]\n"
+			"\t-c: check that the data is relayed unchanged instead of timing it\n"
+			"\t-d: with -t, run sc with -d ms and check the delay after newlines\n"
+			"\t-m: data to relay in each direction, default 64\n"
+			"\t-n: keystrokes for the latency measurement, default 2000\n"
+			"\t-r: send at rate bytes per second, e.g. 300000 for 3 Mbaud,\n"
+			"\t    and report the CPU time sc takes as a share of the time\n"
+			"\t-t: type escapes and newlines at sc and check what it sends\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	char sname[128], cname[128], dname[16], **args;
+	int sfd, sslave, cfd, cslave, devnull;
+	int megabytes = 64, samples = 2000;
+	int ec = 0, c, i, j, status;
+	unsigned char b;
+	struct pollfd pfd;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "+cd:hm:n:r:t?")) != -1) {
+		switch (c) {
+			case 'c':
+				check = 1;
+				break;
+			case 'd':
+				delay = atoi(optarg);
+				break;
+			case 'm':
+				megabytes = atoi(optarg);
+				break;
+			case 'n':
+				samples = atoi(optarg);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 't':
+				typing = 1;
+				break;
+			case 'h':
+			case '?':
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || megabytes <= 0 || samples <= 0 || rate < 0 ||
+			delay < 0 || (delay > 0 && !typing))
+		usage();
+
+	sfd = openpty_raw(&sslave, sname, sizeof(sname));
+	cfd = openpty_raw(&cslave, cname, sizeof(cname));
+	/* no -q, older versions of sc don't handle it */
+	if ((args = calloc(argc + 4, sizeof(*args))) == NULL)
+		err(EX_OSERR, "calloc()");
+	j = 0;
+	args[j++] = argv[0];
+	if (!typing) {
+		args[j++] = "-e";
+		args[j++] = "none";
+	} else if (delay > 0) {
+		snprintf(dname, sizeof(dname), "%d", delay);
+		args[j++] = "-d";
+		args[j++] = dname;
+	}
+	for (i = 1; i < argc; i++)
+		args[j++] = argv[i];
+	args[j] = sname;
+
+	if ((pid = fork()) < 0)
+		err(EX_OSERR, "fork()");
+	if (pid == 0) {
+		devnull = open("/dev/null", O_WRONLY);
+		dup2(cslave, STDIN_FILENO);
+		dup2(cslave, STDOUT_FILENO);
+		if (devnull >= 0)
+			dup2(devnull, STDERR_FILENO);
+		close(sfd);
+		close(cfd);
+		execv(args[0], args);
+		_exit(EX_OSERR);
+	}
+	close(sslave);
+	close(cslave);
+	fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+
+	/* wait until sc relays */
+	for (i = 0; i < 50; i++) {
+		b = '.';
+		write(sfd, &b, 1);
+		pfd.fd = cfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0 && read(cfd, &b, 1) == 1)
+			break;
+	}
+	if (i == 50)
+		errx(EX_SOFTWARE, "%s does not relay", args[0]);
+	while (read(cfd, &b, 1) == 1)
+		;
+
+	if (typing) {
+		printf("sc: %s, typing\n", args[0]);
+		if (typed(cfd, sfd))
+			ec = EX_SOFTWARE;
+	} else {
+		if (check)
+			samples = 0;
+		printf("sc: %s, %d MB per direction, %d keystrokes\n", args[0], megabytes, samples);
+		if (pump("serial -> terminal", sfd, cfd, (size_t)megabytes << 20, pid) ||
+				pump("terminal -> serial", cfd, sfd, (size_t)megabytes << 20, pid)) {
+			ec = EX_SOFTWARE;
+		}
+		fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) & ~O_NONBLOCK);
+		if (ec == 0 && samples > 0 && latency(cfd, sfd, samples))
+			ec = EX_SOFTWARE;
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, &status, 0);
+	close(sfd);
+	close(cfd);
+	return ec;
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2006,2007 Stefan Bethke <stb@lassitu.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sccap.h"
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+/*
+ * Wall clock time in nanoseconds, made monotonic by deriving it from
+ * CLOCK_MONOTONIC relative to the first call.
+ */
+uint64_t
+sccap_now(void)
+{
+	static uint64_t rt0, mono0;
+	struct timespec ts;
+	uint64_t mono;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (rt0 == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		rt0 = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		mono0 = mono;
+	}
+	return rt0 + (mono - mono0);
+}
+
+void
+sccap_puthdr(unsigned char *p, uint64_t start)
+{
+	memcpy(p, SCCAP_MAGIC, 8);
+	put64(p + 8, start);
+}
+
+void
+sccap_putrec(unsigned char *p, const struct sccap_rec *r)
+{
+	put64(p, r->time);
+	p[8] = r->len;
+	p[9] = r->len >> 8;
+	p[10] = r->len >> 16;
+	p[11] = r->len >> 24;
+	p[12] = r->type;
+	p[13] = p[14] = p[15] = 0;
+}
+
+static void
+getrec(const unsigned char *p, struct sccap_rec *r)
+{
+	r->time = get64(p);
+	r->len = p[8] | p[9] << 8 | p[10] << 16 | (uint32_t)p[11] << 24;
+	r->type = p[12];
+}
+
+/*
+ * Note that the record at off starts at time, if it is far enough from
+ * the previous index entry.
+ */
+int
+sccap_index_add(struct sccap_index *idx, uint64_t time, uint64_t off)
+{
+	uint64_t *e;
+
+	if (idx->n > 0 && off - idx->ent[2 * idx->n - 1] < SCCAP_INDEXINTERVAL)
+		return 0;
+	if (idx->n == idx->alloc) {
+		e = realloc(idx->ent, (idx->alloc ? 2 * idx->alloc : 256) * 2 * sizeof(*e));
+		if (e == NULL)
+			return -1;
+		idx->ent = e;
+		idx->alloc = idx->alloc ? 2 * idx->alloc : 256;
+	}
+	idx->ent[2 * idx->n] = time;
+	idx->ent[2 * idx->n + 1] = off;
+	idx->n++;
+	return 0;
+}
+
+/*
+ * Append the index record and footer at off, which must be the end of
+ * the capture.
+ */
+int
+sccap_index_write(int fd, const struct sccap_index *idx, uint64_t off, uint64_t time)
+{
+	struct sccap_rec r;
+	unsigned char *buf, *p;
+	size_t len, i;
+	ssize_t n;
+
+	len = SCCAP_RECSIZE + idx->n * 16 + SCCAP_FTRSIZE;
+	if ((buf = malloc(len)) == NULL)
+		return -1;
+	r.time = time;
+	r.len = idx->n * 16;
+	r.type = SCCAP_INDEX;
+	sccap_putrec(buf, &r);
+	p = buf + SCCAP_RECSIZE;
+	for (i = 0; i < 2 * idx->n; i++, p += 8)
+		put64(p, idx->ent[i]);
+	memcpy(p, SCCAP_IDXMAGIC, 8);
+	put64(p + 8, off);
+	for (p = buf; len > 0; p += n, len -= n) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0)
+			break;
+	}
+	free(buf);
+	return len == 0 ? 0 : -1;
+}
+
+void
+sccap_index_free(struct sccap_index *idx)
+{
+	free(idx->ent);
+	idx->ent = NULL;
+	idx->n = idx->alloc = 0;
+}
+
+/*
+ * Map a whole capture.  Records are then read in place with
+ * sccap_mapnext(), without copying.
+ */
+int
+sccap_map(struct sccap_map *m, const char *fn)
+{
+	struct stat st;
+	const unsigned char *p;
+	uint64_t ioff;
+	int fd;
+
+	memset(m, 0, sizeof(*m));
+	if ((fd = open(fn, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < SCCAP_HDRSIZE) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	m->size = st.st_size;
+	m->base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->base == MAP_FAILED) {
+		m->base = NULL;
+		return -1;
+	}
+	if (memcmp(m->base, SCCAP_MAGIC, 8) != 0) {
+		sccap_unmap(m);
+		errno = EINVAL;
+		return -1;
+	}
+	m->start = get64(m->base + 8);
+	m->end = m->size;
+	if (m->size >= SCCAP_HDRSIZE + SCCAP_RECSIZE + SCCAP_FTRSIZE) {
+		p = m->base + m->size - SCCAP_FTRSIZE;
+		ioff = get64(p + 8);
+		if (memcmp(p, SCCAP_IDXMAGIC, 8) == 0 && ioff >= SCCAP_HDRSIZE &&
+				ioff < m->size)
+			m->end = ioff;
+	}
+#if defined(MADV_SEQUENTIAL)
+	madvise((void *)m->base, m->size, MADV_SEQUENTIAL);
+#endif
+	return 0;
+}
+
+/*
+ * Return the record at *off and advance *off past it; 0 at the end.
+ */
+int
+sccap_mapnext(const struct sccap_map *m, size_t *off, struct sccap_rec *r,
+		const unsigned char **data)
+{
+	if (*off + SCCAP_RECSIZE > m->end)
+		return 0;
+	getrec(m->base + *off, r);
+	if (r->type == SCCAP_INDEX || r->len > m->end - *off - SCCAP_RECSIZE)
+		return 0;
+	*data = m->base + *off + SCCAP_RECSIZE;
+	*off += SCCAP_RECSIZE + r->len;
+	return 1;
+}
+
+void
+sccap_unmap(struct sccap_map *m)
+{
+	if (m->base != NULL)
+		munmap((void *)m->base, m->size);
+	m->base = NULL;
+}
+
+static int
+readbuf(struct sccap *c, size_t len)
+{
+	unsigned char *b;
+
+	if (len > c->bufsize) {
+		if ((b = realloc(c->buf, len)) == NULL)
+			return -1;
+		c->buf = b;
+		c->bufsize = len;
+	}
+	if (len > 0 && fread(c->buf, len, 1, c->f) != 1) {
+		errno = ferror(c->f) ? errno : EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open a capture and load its index, if it has one.
+ */
+int
+sccap_open(struct sccap *c, const char *fn)
+{
+	struct sccap_rec r;
+	unsigned char hdr[SCCAP_HDRSIZE];
+	off_t size;
+	size_t i;
+
+	memset(c, 0, sizeof(*c));
+	if ((c->f = fopen(fn, "rb")) == NULL)
+		return -1;
+	if (fread(hdr, sizeof(hdr), 1, c->f) != 1 ||
+			memcmp(hdr, SCCAP_MAGIC, 8) != 0) {
+		fclose(c->f);
+		errno = EINVAL;
+		return -1;
+	}
+	c->start = get64(hdr + 8);
+	c->off = SCCAP_HDRSIZE;
+	if (fseeko(c->f, 0, SEEK_END) || (size = ftello(c->f)) < 0) {
+		fclose(c->f);
+		return -1;
+	}
+	c->end = size;
+	if (size >= SCCAP_HDRSIZE + SCCAP_RECSIZE + SCCAP_FTRSIZE &&
+			fseeko(c->f, size - SCCAP_FTRSIZE, SEEK_SET) == 0 &&
+			readbuf(c, SCCAP_FTRSIZE) == 0 &&
+			memcmp(c->buf, SCCAP_IDXMAGIC, 8) == 0) {
+		uint64_t ioff = get64(c->buf + 8);
+
+		if (ioff >= SCCAP_HDRSIZE && ioff < (uint64_t)size &&
+				fseeko(c->f, ioff, SEEK_SET) == 0 &&
+				readbuf(c, SCCAP_RECSIZE) == 0) {
+			getrec(c->buf, &r);
+			if (r.type == SCCAP_INDEX && readbuf(c, r.len) == 0) {
+				c->idx.n = c->idx.alloc = r.len / 16;
+				c->idx.ent = malloc(c->idx.n * 16 + 1);
+				for (i = 0; c->idx.ent && i < 2 * c->idx.n; i++)
+					c->idx.ent[i] = get64(c->buf + 8 * i);
+				/* a damaged index only costs the seeking */
+				for (i = 0; c->idx.ent && i < c->idx.n; i++) {
+					if (c->idx.ent[2 * i + 1] < SCCAP_HDRSIZE ||
+							c->idx.ent[2 * i + 1] >= ioff)
+						break;
+				}
+				if (c->idx.ent == NULL || i < c->idx.n) {
+					free(c->idx.ent);
+					c->idx.ent = NULL;
+					c->idx.n = c->idx.alloc = 0;
+				}
+				c->end = ioff;
+			}
+		}
+	}
+	if (fseeko(c->f, c->off, SEEK_SET)) {
+		sccap_close(c);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Position the capture at the first record at or after time.  Uses a
+ * binary search over the index to skip to within SCCAP_INDEXINTERVAL
+ * bytes of it.
+ */
+int
+sccap_seek(struct sccap *c, uint64_t time)
+{
+	struct sccap_rec r;
+	uint64_t off = SCCAP_HDRSIZE;
+	size_t lo = 0, hi = c->idx.n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (c->idx.ent[2 * mid] <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		off = c->idx.ent[2 * (lo - 1) + 1];
+	for (;;) {
+		if (off + SCCAP_RECSIZE > c->end)
+			break;
+		if (fseeko(c->f, off, SEEK_SET) || readbuf(c, SCCAP_RECSIZE))
+			return -1;
+		getrec(c->buf, &r);
+		if (r.time >= time)
+			break;
+		off += SCCAP_RECSIZE + r.len;
+	}
+	c->off = off;
+	return fseeko(c->f, off, SEEK_SET);
+}
+
+/*
+ * Read the next record.  Returns 1 and points *data to the record's data,
+ * valid until the next call, or 0 at the end of the capture.
+ */
+int
+sccap_next(struct sccap *c, struct sccap_rec *r, const unsigned char **data)
+{
+	if (c->off + SCCAP_RECSIZE > c->end)
+		return 0;
+	if (readbuf(c, SCCAP_RECSIZE))
+		return feof(c->f) ? 0 : -1;
+	getrec(c->buf, r);
+	if (r->type == SCCAP_INDEX || c->off + SCCAP_RECSIZE + r->len > c->end)
+		return 0;
+	if (readbuf(c, r->len))
+		return feof(c->f) ? 0 : -1;
+	c->off += SCCAP_RECSIZE + r->len;
+	*data = c->buf;
+	return 1;
+}
+
+void
+sccap_close(struct sccap *c)
+{
+	if (c->f != NULL)
+		fclose(c->f);
+	c->f = NULL;
+	sccap_index_free(&c->idx);
+	free(c->buf);
+	c->buf = NULL;
+}
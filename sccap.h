@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2006,2007 Stefan Bethke <stb@lassitu.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Capture file format, shared by sc -w and scdump.
+ *
+ * All integers are little endian.  A capture starts with a 16 byte file
+ * header (magic, start time), followed by records.  Each record has a 16
+ * byte header (time, length, type, 3 bytes padding) and length bytes of
+ * data.  Times are nanoseconds since the epoch and never decrease within a
+ * file.
+ *
+ * When the capture is closed, an SCCAP_INDEX record holding pairs of
+ * (time, offset) for roughly every SCCAP_INDEXINTERVAL bytes is appended,
+ * followed by a 16 byte footer (magic, offset of the index record), so
+ * that readers can seek by time without reading the whole file.  Captures
+ * without a footer (sc was killed) are read sequentially.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define SCCAP_MAGIC		"SCCAP01\n"
+#define SCCAP_IDXMAGIC		"SCIDX01\n"
+#define SCCAP_HDRSIZE		16
+#define SCCAP_RECSIZE		16
+#define SCCAP_FTRSIZE		16
+#define SCCAP_INDEXINTERVAL	(1024 * 1024)
+
+enum sccap_type {
+	SCCAP_RX = 1,		/* received from the serial device */
+	SCCAP_TX,		/* sent to the serial device */
+	SCCAP_BREAK,		/* break sent, no data */
+	SCCAP_INDEX,		/* time index, see above */
+};
+
+struct sccap_rec {
+	uint64_t time;
+	uint32_t len;
+	uint8_t type;
+};
+
+struct sccap_index {
+	uint64_t *ent;		/* time, offset pairs */
+	size_t n;
+	size_t alloc;
+};
+
+struct sccap {
+	FILE *f;
+	uint64_t start;		/* time from the file header */
+	uint64_t end;		/* offset of the index record or end of file */
+	uint64_t off;		/* offset of the next record */
+	struct sccap_index idx;
+	unsigned char *buf;
+	size_t bufsize;
+};
+
+uint64_t	sccap_now(void);
+void		sccap_puthdr(unsigned char *, uint64_t);
+void		sccap_putrec(unsigned char *, const struct sccap_rec *);
+int		sccap_index_add(struct sccap_index *, uint64_t, uint64_t);
+int		sccap_index_write(int, const struct sccap_index *, uint64_t, uint64_t);
+void		sccap_index_free(struct sccap_index *);
+
+/* a capture mapped into memory, for replay */
+struct sccap_map {
+	const unsigned char *base;
+	size_t size;
+	uint64_t start;
+	size_t end;		/* offset of the index record or end of file */
+};
+
+int		sccap_map(struct sccap_map *, const char *);
+int		sccap_mapnext(const struct sccap_map *, size_t *, struct sccap_rec *, const unsigned char **);
+void		sccap_unmap(struct sccap_map *);
+
+int		sccap_open(struct sccap *, const char *);
+int		sccap_seek(struct sccap *, uint64_t);
+int		sccap_next(struct sccap *, struct sccap_rec *, const unsigned char **);
+void		sccap_close(struct sccap *);
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2006,2007 Stefan Bethke <stb@lassitu.de>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Print or slice captures written by sc -w.
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "sccap.h"
+
+static const char *typenames[] = { "?", "rx", "tx", "break", "index" };
+
+/*
+ * Parse a time: seconds since the start of the capture, or seconds since
+ * the epoch if prefixed with '@'.
+ */
+static uint64_t
+parsetime(const char *s, uint64_t start)
+{
+	double d;
+	char *ep;
+	int abs = 0;
+
+	if (*s == '@') {
+		abs = 1;
+		s++;
+	}
+	d = strtod(s, &ep);
+	if (ep == s || *ep != '\0' || d < 0)
+		errx(EX_USAGE, "Invalid time \"%s\"", s);
+	return (abs ? 0 : start) + (uint64_t)(d * 1e9);
+}
+
+static void
+writeall(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err(EX_IOERR, "write");
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Print or slice a capture written by sc -w.\n"
+			"usage:\tscdump [-l] [-d rx|tx|all] [-s start] [-e end] [-w output] capture\n"
+			"\t-l: list records instead of printing their data\n"
+			"\t-d: only records in this direction, default rx (all with -l or -w)\n"
+			"\t-s: first time to include\n"
+			"\t-e: first time to exclude\n"
+			"\t-w: write the selected records to a new capture\n"
+			"times are seconds since the start of the capture, or since the epoch\n"
+			"if prefixed with '@'\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sccap cap;
+	struct sccap_rec r;
+	struct sccap_index idx;
+	const unsigned char *data;
+	unsigned char hdr[SCCAP_RECSIZE];
+	char *start = NULL, *end = NULL, *out = NULL;
+	uint64_t from = 0, to = UINT64_MAX, off = 0, last = 0;
+	int lflag = 0, dir = -1;
+	int ofd = -1, i, c;
+
+	while ((c = getopt(argc, argv, "d:e:hls:w:?")) != -1) {
+		switch (c) {
+			case 'd':
+				if (strcmp(optarg, "rx") == 0)
+					dir = SCCAP_RX;
+				else if (strcmp(optarg, "tx") == 0)
+					dir = SCCAP_TX;
+				else if (strcmp(optarg, "all") == 0)
+					dir = 0;
+				else
+					errx(EX_USAGE, "Invalid direction \"%s\"", optarg);
+				break;
+			case 'e':
+				end = optarg;
+				break;
+			case 'l':
+				lflag = 1;
+				break;
+			case 's':
+				start = optarg;
+				break;
+			case 'w':
+				out = optarg;
+				break;
+			case 'h':
+			case '?':
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	if (dir == -1)
+		dir = lflag || out ? 0 : SCCAP_RX;
+
+	if (sccap_open(&cap, argv[0]) < 0)
+		err(EX_NOINPUT, "%s", argv[0]);
+	if (start != NULL)
+		from = parsetime(start, cap.start);
+	if (end != NULL)
+		to = parsetime(end, cap.start);
+	if (cap.idx.n == 0 && start != NULL)
+		warnx("%s has no index, reading sequentially", argv[0]);
+	if (sccap_seek(&cap, from) < 0)
+		err(EX_IOERR, "%s", argv[0]);
+
+	if (out != NULL) {
+		if ((ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+			err(EX_CANTCREAT, "%s", out);
+		memset(&idx, 0, sizeof(idx));
+		sccap_puthdr(hdr, cap.start);
+		writeall(ofd, hdr, SCCAP_HDRSIZE);
+		off = SCCAP_HDRSIZE;
+		last = cap.start;
+	}
+
+	while ((i = sccap_next(&cap, &r, &data)) > 0 && r.time < to) {
+		if (dir != 0 && r.type != dir)
+			continue;
+		if (ofd != -1) {
+			if (sccap_index_add(&idx, r.time, off) < 0)
+				err(EX_OSERR, "index");
+			sccap_putrec(hdr, &r);
+			writeall(ofd, hdr, SCCAP_RECSIZE);
+			writeall(ofd, data, r.len);
+			off += SCCAP_RECSIZE + r.len;
+			last = r.time;
+		} else if (lflag) {
+			printf("%14.6f %-5s %u\n", (r.time - cap.start) / 1e9,
+				r.type < sizeof(typenames)/sizeof(typenames[0]) ?
+				typenames[r.type] : "?", r.len);
+		} else {
+			writeall(STDOUT_FILENO, data, r.len);
+		}
+	}
+	if (i < 0)
+		err(EX_IOERR, "%s", argv[0]);
+	if (ofd != -1) {
+		if (sccap_index_write(ofd, &idx, off, last) < 0 || close(ofd))
+			err(EX_IOERR, "%s", out);
+		sccap_index_free(&idx);
+	}
+	sccap_close(&cap);
+	return 0;
+}